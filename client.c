@@ -6,17 +6,65 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <unistd.h>
 
 // for reference
 static int create_client_socket();
 static int try_connect(int sock, const char *file);
 static char *prepend_cwd(const char *file);
+static int connect_to(const char *path);
+static void close_server_and_wait(const char *path);
 static int connect_or_die();
 static void run_server_and_wait(const char *path);
+static char *absolute_path(const char *file);
+static int read_buffer(tpl_bin *buffer, const char *fn);
+static int parse_int(int *out, const char *s);
+static int parse_ac_args(struct msg_ac *msg, int argc, char **argv);
+static int parse_more_args(struct msg_ac_more *msg, int argc, char **argv);
+static int parse_open_args(struct msg_open *msg, int argc, char **argv);
+static int parse_resolve_args(struct msg_resolve *msg, int argc, char **argv);
+static void print_vim_string(const char *s);
+static int send_msg(int sock, int msgtype, tpl_node *body);
+static void print_proposal(struct ac_proposal *p);
+static void print_proposals(struct msg_ac_response *msg, int first);
+static void print_ac_response(struct msg_ac_response *msg);
+static int print_ac_stream(struct msg_ac_response *msg, int sock);
+static void print_ac_delta(struct msg_ac_delta_response *msg);
+static struct kept_file *keep_buffer(struct msg_ac *msg);
+static void free_kept_files(struct kept_file *k);
+static void send_whole_buffer(struct msg_ac *msg, struct kept_file *k);
+static int request_ac(int sock, struct msg_ac *msg);
+static int send_ac(int sock, struct msg_ac *msg, struct kept_file *k);
+static int request_more(int sock, struct msg_ac_more *msg);
+static int request_open(int sock, struct msg_open *msg);
+static int request_resolve(int sock, struct msg_resolve *msg);
+static void pipe_main();
+static void print_usage();
 
 //-------------------------------------------------------------------------
 
+// set by parse_ac_args and parse_more_args, AC_FUZZY and AC_EXACT only
+static int print_flags;
+static int print_ids;
+
+// completion responses are binary frames, read through this
+static struct frame_buffer frames;
+
+// The last buffer 'ccode pipe' has sent for each file, -edit applies to it.
+// The daemon keeps the same ones for the connection.
+struct kept_file {
+	char *filename;
+	char *data;
+	size_t size;
+	struct kept_file *next;
+};
+
+#define MAX_KEPT_FILES 8
+
+static struct kept_file *kept_files;
+static int keep_buffers;
+
 static int create_client_socket()
 {
 	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -75,6 +123,40 @@ static void run_server_and_wait(const char *path)
 	}
 }
 
+static int connect_to(const char *path)
+{
+	int sock = create_client_socket();
+	if (sock == -1) {
+		fprintf(stderr, "Error! Failed to create a client socket: %s\n", path);
+		exit(1);
+	}
+
+	if (-1 == try_connect(sock, path)) {
+		fprintf(stderr, "Error! Failed to connect to a server at: %s\n", path);
+		exit(1);
+	}
+	return sock;
+}
+
+// A daemon of another version is still running, e.g. after an upgrade. It's
+// told to quit, the caller starts a new one.
+static void close_server_and_wait(const char *path)
+{
+	int sock = connect_to(path);
+	send_msg(sock, MSG_CLOSE, 0);
+	close(sock);
+
+	// wait for 10ms up to 200 times (2 seconds) for it to go
+	for (int i = 0; i < 200; ++i) {
+		if (!file_exists(path))
+			return;
+		usleep(10000);
+	}
+	fprintf(stderr, "Failed to close a server of another version: %s\n",
+		path);
+	exit(1);
+}
+
 static int connect_or_die()
 {
 	str_t *path;
@@ -85,21 +167,18 @@ static int connect_or_die()
 	if (!file_exists(path->data))
 		run_server_and_wait(path->data);
 
-	sock = create_client_socket();
-	if (sock == -1) {
-		fprintf(stderr, "Error! Failed to create a client socket: %s\n", path->data);
-		exit(1);
-	}
-
-	if (-1 == try_connect(sock, (char*)path->data)) {
-		fprintf(stderr, "Error! Failed to connect to a server at: %s\n", path->data);
-		exit(1);
+	sock = connect_to(path->data);
+	send_msg(sock, MSG_VERSION, 0);
+	if (msg_version_response_recv(sock) != PROTOCOL_VERSION) {
+		close(sock);
+		close_server_and_wait(path->data);
+		run_server_and_wait(path->data);
+		sock = connect_to(path->data);
 	}
 	str_free(path);
 	return sock;
 }
 
-
 static char *prepend_cwd(const char *file)
 {
 	str_t *tmp;
@@ -121,6 +200,566 @@ static char *prepend_cwd(const char *file)
 	return ret;
 }
 
+static char *absolute_path(const char *file)
+{
+	if (starts_with(file, "/"))
+		return strdup(file);
+	return prepend_cwd(file);
+}
+
+// reads a buffer from the file 'fn' or from stdin if 'fn' is zero
+static int read_buffer(tpl_bin *buffer, const char *fn)
+{
+	size_t sz;
+
+	if (fn) {
+		if (read_file(&buffer->addr, &sz, fn) == -1) {
+			fprintf(stderr, "Error! Failed to read from file: %s\n", fn);
+			return -1;
+		}
+	} else {
+		if (read_stdin(&buffer->addr, &sz) == -1) {
+			fprintf(stderr, "Error! Failed to read from stdin\n");
+			return -1;
+		}
+	}
+	buffer->sz = (uint32_t)sz;
+	return 0;
+}
+
+static int parse_int(int *out, const char *s)
+{
+	char *end;
+
+	*out = strtol(s, &end, 10);
+	if (*end != '\0') {
+		fprintf(stderr, "Failed to parse an int from string: %s\n", s);
+		return -1;
+	}
+	return 0;
+}
+
+// ac [-fuzzy] [-collapse] [-exact] [-ids] [-limit <n> [-tail]] [-page <n>]
+//    [-stream] [-delta] [-edit <start> <end>]
+//    <filename> <line> <col> [<buffer file>]
+static int parse_ac_args(struct msg_ac *msg, int argc, char **argv)
+{
+	msg->flags = 0;
+	msg->limit = 0;
+	msg->page = 0;
+	msg->edit_start = 0;
+	msg->edit_end = 0;
+	msg->hash = 0;
+	print_ids = 0;
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-ids") == 0) {
+			print_ids = 1;
+		} else if (strcmp(argv[1], "-fuzzy") == 0) {
+			msg->flags |= AC_FUZZY;
+		} else if (strcmp(argv[1], "-collapse") == 0) {
+			msg->flags |= AC_COLLAPSE;
+		} else if (strcmp(argv[1], "-exact") == 0) {
+			msg->flags |= AC_EXACT;
+		} else if (strcmp(argv[1], "-tail") == 0) {
+			msg->flags |= AC_UNSORTED_TAIL;
+		} else if (strcmp(argv[1], "-stream") == 0) {
+			msg->flags |= AC_STREAM;
+		} else if (strcmp(argv[1], "-delta") == 0) {
+			msg->flags |= AC_DELTA;
+		} else if (strcmp(argv[1], "-limit") == 0 && argc > 2) {
+			if (parse_int(&msg->limit, argv[2]) == -1)
+				return -1;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "-page") == 0 && argc > 2) {
+			if (parse_int(&msg->page, argv[2]) == -1)
+				return -1;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "-edit") == 0 && argc > 3) {
+			if (parse_int(&msg->edit_start, argv[2]) == -1 ||
+			    parse_int(&msg->edit_end, argv[3]) == -1)
+				return -1;
+			msg->flags |= AC_EDIT;
+			argv += 2;
+			argc -= 2;
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[1]);
+			return -1;
+		}
+		argv++;
+		argc--;
+	}
+
+	if (argc != 4 && argc != 5) {
+		fprintf(stderr, "Not enough arguments\n");
+		return -1;
+	}
+
+	if (parse_int(&msg->line, argv[2]) == -1)
+		return -1;
+	if (parse_int(&msg->col, argv[3]) == -1)
+		return -1;
+
+	// if there is a fourth argument, load currently editted buffer
+	// from a file, otherwise use stdin
+	if (read_buffer(&msg->buffer, (argc == 5) ? argv[4] : 0) == -1)
+		return -1;
+
+	msg->filename = absolute_path(argv[1]);
+	print_flags = msg->flags & (AC_FUZZY | AC_EXACT);
+	return 0;
+}
+
+// more [-fuzzy] [-exact] [-ids] <cursor> <n>
+// (the options only change the output, they should be the same as for ac)
+static int parse_more_args(struct msg_ac_more *msg, int argc, char **argv)
+{
+	print_flags = 0;
+	print_ids = 0;
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-ids") == 0) {
+			print_ids = 1;
+		} else if (strcmp(argv[1], "-fuzzy") == 0) {
+			print_flags |= AC_FUZZY;
+		} else if (strcmp(argv[1], "-exact") == 0) {
+			print_flags |= AC_EXACT;
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[1]);
+			return -1;
+		}
+		argv++;
+		argc--;
+	}
+
+	if (argc != 3) {
+		fprintf(stderr, "Not enough arguments\n");
+		return -1;
+	}
+	if (parse_int(&msg->cursor, argv[1]) == -1)
+		return -1;
+	if (parse_int(&msg->page, argv[2]) == -1)
+		return -1;
+	return 0;
+}
+
+// open <filename> [<buffer file>]
+static int parse_open_args(struct msg_open *msg, int argc, char **argv)
+{
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Not enough arguments\n");
+		return -1;
+	}
+
+	// the buffer comes from stdin without a buffer file, the file may
+	// not even exist on disk yet
+	if (read_buffer(&msg->buffer, (argc == 3) ? argv[2] : 0) == -1)
+		return -1;
+
+	msg->filename = absolute_path(argv[1]);
+	return 0;
+}
+
+// resolve <filename> <id>
+static int parse_resolve_args(struct msg_resolve *msg, int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "Not enough arguments\n");
+		return -1;
+	}
+	if (parse_int(&msg->id, argv[2]) == -1)
+		return -1;
+
+	msg->filename = absolute_path(argv[1]);
+	return 0;
+}
+
+// sends msg type followed by the msg itself (if any), frees 'body'
+static int send_msg(int sock, int msgtype, tpl_node *body)
+{
+	int rc;
+	tpl_node *tn = msg_node_pack(msgtype);
+	rc = tpl_dump(tn, TPL_FD, sock);
+	tpl_free(tn);
+
+	if (body) {
+		if (rc == 0) {
+			tpl_pack(body, 0);
+			rc = tpl_dump(body, TPL_FD, sock);
+		}
+		tpl_free(body);
+	}
+	return rc;
+}
+
+// Prints the response as a vim list:
+// [partial, [{'word':..,'abbr':..}, ..], truncated, cursor].
+// Fuzzy matches don't start with the partial identifier, vim would throw
+// them away without 'equal'. Collapsed groups show their size in 'menu',
+// variants of an exact match all have the same word and need 'dup'. With
+// 'print_ids', 'user_data' is the id for 'ccode resolve' and 'info' is a
+// placeholder, vim doesn't make an info popup for items without it.
+static void print_ac_response(struct msg_ac_response *msg)
+{
+	printf("[%d, [", msg->partial);
+	print_proposals(msg, 1);
+	printf("], %d, %d]", msg->truncated, msg->cursor);
+}
+
+// the list items, 'first' is zero if others have been printed before them
+static void print_proposals(struct msg_ac_response *msg, int first)
+{
+	for (size_t i = 0; i < msg->proposals_n; ++i) {
+		if (!first || i)
+			printf(",");
+		print_proposal(&msg->proposals[i]);
+	}
+}
+
+static void print_proposal(struct ac_proposal *p)
+{
+	printf("{'word':'%s','abbr':'%s'", p->word, p->abbr);
+	if (print_flags & AC_FUZZY)
+		printf(",'equal':1");
+	if (print_flags & AC_EXACT)
+		printf(",'dup':1");
+	if (p->count > 1)
+		printf(",'menu':'[%d]'", p->count);
+	if (print_ids)
+		printf(",'user_data':'%d','info':' '", p->id);
+	printf("}");
+}
+
+// Same as print_ac_response, but proposals which were in the last list are
+// printed as their index in it. The last list is the last one printed this
+// way by the same 'ccode pipe', unless it was AC_CANCELLED.
+static void print_ac_delta(struct msg_ac_delta_response *msg)
+{
+	struct ac_proposal *p = msg->proposals;
+
+	printf("[%d, [", msg->partial);
+	for (size_t i = 0; i < msg->refs_n; ++i) {
+		if (i)
+			printf(",");
+		if (msg->refs[i] >= 0)
+			printf("%d", msg->refs[i]);
+		else if (p != msg->proposals + msg->proposals_n)
+			print_proposal(p++);
+	}
+	printf("], %d, 0]", msg->truncated);
+}
+
+// Same as print_ac_response, but each response of the stream is printed and
+// flushed as soon as it arrives. The last element is -1 instead of the
+// cursor if the stream was cut short, there is no way to take back what's
+// printed already.
+static int print_ac_stream(struct msg_ac_response *msg, int sock)
+{
+	int first = 1;
+	int cut = 0;
+
+	printf("[%d, [", msg->partial);
+	while (1) {
+		print_proposals(msg, first);
+		fflush(stdout);
+		if (msg->proposals_n)
+			first = 0;
+		if (msg->cursor != AC_STREAMED)
+			break;
+
+		free_msg_ac_response(msg);
+		if (msg_ac_response_recv_bin(msg, &frames, sock) == -1) {
+			printf("], 0, -1]");
+			return 0;
+		}
+		cut = (msg->partial == AC_CANCELLED);
+	}
+	printf("], %d, %d]", msg->truncated, (cut) ? -1 : msg->cursor);
+	free_msg_ac_response(msg);
+	return 0;
+}
+
+// Applies an -edit to the kept copy of the file and sets the hash of the
+// result, or keeps a copy of the whole buffer. Zero if there is nothing to
+// apply the edit to.
+static struct kept_file *keep_buffer(struct msg_ac *msg)
+{
+	struct kept_file **pk = &kept_files;
+	struct kept_file *k;
+
+	while (*pk && strcmp((*pk)->filename, msg->filename) != 0)
+		pk = &(*pk)->next;
+	k = *pk;
+	if (k)
+		*pk = k->next;
+
+	if (msg->flags & AC_EDIT) {
+		if (!k || replace_lines(&k->data, &k->size, msg->edit_start,
+					msg->edit_end, msg->buffer.addr,
+					msg->buffer.sz) == -1) {
+			free_kept_files(k);
+			return 0;
+		}
+		msg->hash = hash_bytes(HASH_INIT, k->data, k->size);
+	} else {
+		if (!k) {
+			k = calloc(1, sizeof(struct kept_file));
+			k->filename = strdup(msg->filename);
+		}
+		k->data = realloc(k->data, msg->buffer.sz);
+		k->size = msg->buffer.sz;
+		memcpy(k->data, msg->buffer.addr, msg->buffer.sz);
+		msg->flags |= AC_KEEP;
+	}
+
+	// the most recently used one goes first, the last one goes if there
+	// are too many
+	k->next = kept_files;
+	kept_files = k;
+	pk = &k->next;
+	for (int n = 1; *pk; n++, pk = &(*pk)->next) {
+		if (n == MAX_KEPT_FILES) {
+			free_kept_files(*pk);
+			*pk = 0;
+			break;
+		}
+	}
+	return k;
+}
+
+static void free_kept_files(struct kept_file *k)
+{
+	while (k) {
+		struct kept_file *next = k->next;
+		free(k->filename);
+		free(k->data);
+		free(k);
+		k = next;
+	}
+}
+
+// the daemon has lost the buffer the edit applies to, e.g. it was restarted
+static void send_whole_buffer(struct msg_ac *msg, struct kept_file *k)
+{
+	free(msg->buffer.addr);
+	msg->buffer.addr = malloc(k->size);
+	msg->buffer.sz = k->size;
+	memcpy(msg->buffer.addr, k->data, k->size);
+	msg->flags = (msg->flags & ~AC_EDIT) | AC_KEEP;
+}
+
+// Within 'ccode pipe' buffers are kept for -edit, which sends only the lines
+// that have changed. The response is AC_RESEND if there is nothing to apply
+// the edit to, the editor should send the whole buffer then.
+static int request_ac(int sock, struct msg_ac *msg)
+{
+	struct kept_file *k = 0;
+
+	if (keep_buffers) {
+		k = keep_buffer(msg);
+		if (!k) {
+			printf("[%d, [], 0, 0]", AC_RESEND);
+			return 0;
+		}
+	}
+	return send_ac(sock, msg, k);
+}
+
+static int send_ac(int sock, struct msg_ac *msg, struct kept_file *k)
+{
+	struct msg_ac_response msg_r;
+
+	if (msg_ac_send_bin(msg, sock) == -1)
+		return -1;
+	if (msg->flags & AC_DELTA) {
+		struct msg_ac_delta_response msg_d;
+
+		if (msg_ac_delta_response_recv_bin(&msg_d, &frames, sock) == -1)
+			return -1;
+		if (msg_d.partial == AC_RESEND && k) {
+			free_msg_ac_delta_response(&msg_d);
+			send_whole_buffer(msg, k);
+			return send_ac(sock, msg, 0);
+		}
+		print_ac_delta(&msg_d);
+		free_msg_ac_delta_response(&msg_d);
+		return 0;
+	}
+	if (msg_ac_response_recv_bin(&msg_r, &frames, sock) == -1)
+		return -1;
+	if (msg_r.partial == AC_RESEND && k) {
+		free_msg_ac_response(&msg_r);
+		send_whole_buffer(msg, k);
+		return send_ac(sock, msg, 0);
+	}
+	if (msg->flags & AC_STREAM)
+		return print_ac_stream(&msg_r, sock);
+
+	print_ac_response(&msg_r);
+	free_msg_ac_response(&msg_r);
+	return 0;
+}
+
+// same output as request_ac, the cursor is zero on the last page
+static int request_more(int sock, struct msg_ac_more *msg)
+{
+	struct msg_ac_response msg_r;
+
+	if (send_msg(sock, MSG_AC_MORE, msg_ac_more_node(msg)) == -1)
+		return -1;
+	if (msg_ac_response_recv(&msg_r, sock) == -1)
+		return -1;
+
+	print_ac_response(&msg_r);
+	free_msg_ac_response(&msg_r);
+	return 0;
+}
+
+// single quoted, on one line
+static void print_vim_string(const char *s)
+{
+	printf("'");
+	for (; s && *s; s++) {
+		if (*s == '\'')
+			printf("''");
+		else if (*s == '\n' || *s == '\r')
+			printf(" ");
+		else
+			putchar(*s);
+	}
+	printf("'");
+}
+
+// Prints the response as a vim dict: {'availability':.., 'signature':..,
+// 'comment':.., 'parent':..}, availability is -1 if the proposal is gone.
+static int request_resolve(int sock, struct msg_resolve *msg)
+{
+	struct msg_resolve_response msg_r;
+
+	if (send_msg(sock, MSG_RESOLVE, msg_resolve_node(msg)) == -1)
+		return -1;
+	if (msg_resolve_response_recv(&msg_r, sock) == -1)
+		return -1;
+
+	printf("{'availability':%d,'signature':", msg_r.availability);
+	print_vim_string(msg_r.signature);
+	printf(",'comment':");
+	print_vim_string(msg_r.comment);
+	printf(",'parent':");
+	print_vim_string(msg_r.parent);
+	printf("}");
+	free_msg_resolve_response(&msg_r);
+	return 0;
+}
+
+// the server parses the file on its own, there is no response
+static int request_open(int sock, struct msg_open *msg)
+{
+	return send_msg(sock, MSG_OPEN, msg_open_node(msg));
+}
+
+// Reads commands from stdin, one per line with tab separated arguments, and
+// sends them over a single connection. Useful for editors which can keep a
+// process around, e.g. vim jobs. Each command prints exactly one line, it's
+// empty for commands without a response.
+static void pipe_main()
+{
+	char *line = 0;
+	size_t line_cap = 0;
+	ssize_t len;
+	int sock = connect_or_die();
+
+	keep_buffers = 1;
+
+	// a write to a dead server is handled by reconnecting
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((len = getline(&line, &line_cap, stdin)) != -1) {
+		char *argv[32];
+		int argc = 0;
+		int rc = -1;
+
+		if (len && line[len-1] == '\n')
+			line[len-1] = '\0';
+		for (char *c = strtok(line, "\t"); c && argc < 32; c = strtok(0, "\t"))
+			argv[argc++] = c;
+		if (!argc)
+			continue;
+
+		// the server might have quit meanwhile, reconnect once
+		for (int attempt = 0; attempt < 2 && rc == -1; attempt++) {
+			if (attempt) {
+				close(sock);
+				sock = connect_or_die();
+				frames.start = frames.len = 0;
+
+				// the daemon doesn't have them either, an
+				// edit gets AC_RESEND
+				free_kept_files(kept_files);
+				kept_files = 0;
+			}
+
+			if (strcmp(argv[0], "ac") == 0) {
+				struct msg_ac msg;
+				if (parse_ac_args(&msg, argc, argv) == -1)
+					break;
+				rc = request_ac(sock, &msg);
+				free_msg_ac(&msg);
+			} else if (strcmp(argv[0], "more") == 0) {
+				struct msg_ac_more msg;
+				if (parse_more_args(&msg, argc, argv) == -1)
+					break;
+				rc = request_more(sock, &msg);
+			} else if (strcmp(argv[0], "open") == 0) {
+				struct msg_open msg;
+				if (parse_open_args(&msg, argc, argv) == -1)
+					break;
+				rc = request_open(sock, &msg);
+				free_msg_open(&msg);
+			} else if (strcmp(argv[0], "resolve") == 0) {
+				struct msg_resolve msg;
+				if (parse_resolve_args(&msg, argc, argv) == -1)
+					break;
+				rc = request_resolve(sock, &msg);
+				free_msg_resolve(&msg);
+			} else {
+				fprintf(stderr, "Unknown command: %s\n", argv[0]);
+				break;
+			}
+		}
+
+		if (rc == -1 && (strcmp(argv[0], "ac") == 0 ||
+				 strcmp(argv[0], "more") == 0))
+			printf("[0, [], 0, 0]");
+		if (rc == -1 && strcmp(argv[0], "resolve") == 0)
+			printf("{'availability':-1}");
+		printf("\n");
+		fflush(stdout);
+	}
+	free(line);
+	free_frame_buffer(&frames);
+	free_kept_files(kept_files);
+	close(sock);
+}
+
+static void print_usage()
+{
+	printf("ccode client, commands:\n"
+	       "  close\n"
+	       "  stats\n"
+	       "  open <filename> [<buffer file>]\n"
+	       "  ac [-fuzzy] [-collapse] [-exact] [-ids] [-limit <n> [-tail]]\n"
+	       "     [-page <n>] [-stream] [-delta] [-edit <start> <end>]\n"
+	       "     <filename> <line> <col> [<buffer file>]\n"
+	       "     (the buffer is read from stdin if there is no buffer file,\n"
+	       "     with -edit it replaces lines <start> to <end> of the last\n"
+	       "     one sent by the same pipe, counting from zero)\n"
+	       "  more [-fuzzy] [-exact] [-ids] <cursor> <n>\n"
+	       "     (the next <n> proposals of a paged ac, see -page)\n"
+	       "  resolve <filename> <id> (details of a proposal, see -ids)\n"
+	       "  pipe (reads tab separated commands from stdin)\n");
+}
+
 //-------------------------------------------------------------------------
 
 void client_main(int argc, char **argv)
@@ -128,91 +767,76 @@ void client_main(int argc, char **argv)
 	int sock;
 
 	if (argc < 2) {
-		printf("ccode client, commands:\n"
-		       "  close\n"
-		       "  ac <filename> <line> <col> (+ currently editted buffer as stdin)\n");
+		print_usage();
 		return;
 	}
 
 	if (strcmp(argv[1], "close") == 0) {
 		sock = connect_or_die();
-		tpl_node *tn = msg_node_pack(MSG_CLOSE);
-		tpl_dump(tn, TPL_FD, sock);
-		tpl_free(tn);
+		send_msg(sock, MSG_CLOSE, 0);
 		close(sock);
-	} else if (strcmp(argv[1], "ac") == 0) {
+	} else if (strcmp(argv[1], "stats") == 0) {
 		sock = connect_or_die();
-		char *end;
-		size_t sz;
-		struct msg_ac msg;
+		send_msg(sock, MSG_STATS, 0);
 
-		if (argc != 5 && argc != 6) {
-			fprintf(stderr, "Not enough arguments\n");
-			exit(1);
+		char *text = msg_stats_response_recv(sock);
+		if (text) {
+			printf("%s", text);
+			free(text);
 		}
+		close(sock);
+	} else if (strcmp(argv[1], "open") == 0) {
+		struct msg_open msg;
 
-		if (starts_with(argv[2], "/"))
-			msg.filename = strdup(argv[2]);
-		else
-			msg.filename = prepend_cwd(argv[2]);
-
-		msg.line = strtol(argv[3], &end, 10);
-		if (*end != '\0') {
-			fprintf(stderr, "Failed to parse an int from string: %s\n", argv[3]);
+		if (parse_open_args(&msg, argc - 1, argv + 1) == -1)
 			exit(1);
-		}
-		msg.col = strtol(argv[4], &end, 10);
-		if (*end != '\0') {
-			fprintf(stderr, "Failed to parse an int from string: %s\n", argv[4]);
+
+		sock = connect_or_die();
+		request_open(sock, &msg);
+		free_msg_open(&msg);
+		close(sock);
+	} else if (strcmp(argv[1], "ac") == 0) {
+		struct msg_ac msg;
+
+		if (parse_ac_args(&msg, argc - 1, argv + 1) == -1)
 			exit(1);
-		}
 
-		// if there is a fifth argument, load currently editted buffer
-		// from a file, otherwise use stdin
-		if (argc == 6) {
-			const char *fn = argv[5];
-			if (read_file(&msg.buffer.addr, &sz, fn) == -1) {
-				fprintf(stderr, "Error! Failed to read from file: %s\n", fn);
-				exit(1);
-			}
-			msg.buffer.sz = (uint32_t)sz;
-		} else {
-			if (read_stdin(&msg.buffer.addr, &sz) == -1) {
-				fprintf(stderr, "Error! Failed to read from stdin\n");
-				exit(1);
-			}
-			msg.buffer.sz = (uint32_t)sz;
+		sock = connect_or_die();
+		if (request_ac(sock, &msg) == -1) {
+			fprintf(stderr, "Error! Failed to get a response from the server\n");
+			exit(1);
 		}
+		free_msg_ac(&msg);
+		close(sock);
+	} else if (strcmp(argv[1], "more") == 0) {
+		struct msg_ac_more msg;
 
-		// send msg type
-		tpl_node *tn = msg_node_pack(MSG_AC);
-		tpl_dump(tn, TPL_FD, sock);
-		tpl_free(tn);
-
-		// send ac msg itself
-		tn = msg_ac_node(&msg);
-		tpl_pack(tn, 0);
-		tpl_dump(tn, TPL_FD, sock);
-		tpl_free(tn);
+		if (parse_more_args(&msg, argc - 1, argv + 1) == -1)
+			exit(1);
 
-		struct msg_ac_response msg_r;
+		sock = connect_or_die();
+		if (request_more(sock, &msg) == -1) {
+			fprintf(stderr, "Error! Failed to get a response from the server\n");
+			exit(1);
+		}
+		close(sock);
+	} else if (strcmp(argv[1], "resolve") == 0) {
+		struct msg_resolve msg;
 
-		msg_ac_response_recv(&msg_r, sock);
-		printf("[%d, [", msg_r.partial);
-		for (size_t i = 0; i < msg_r.proposals_n; ++i) {
-			struct ac_proposal *p = &msg_r.proposals[i];
-			printf("{'word':'%s','abbr':'%s'}", p->word, p->abbr);
-			if (i != msg_r.proposals_n - 1)
-				printf(",");
+		if (parse_resolve_args(&msg, argc - 1, argv + 1) == -1)
+			exit(1);
 
+		sock = connect_or_die();
+		if (request_resolve(sock, &msg) == -1) {
+			fprintf(stderr, "Error! Failed to get a response from the server\n");
+			exit(1);
 		}
-		printf("]]");
-		free_msg_ac_response(&msg_r);
+		free_msg_resolve(&msg);
 		close(sock);
+	} else if (strcmp(argv[1], "pipe") == 0) {
+		pipe_main();
 	} else {
-		printf("ccode client, commands:\n"
-		       "  close\n"
-		       "  ac <filename> <line> <col> (+ currently editted buffer as stdin)\n");
+		print_usage();
 	}
 
 }
@@ -0,0 +1,434 @@
+#include "server.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// A client connection. Clients may keep it open and send any number of
+// messages, each message is a tpl image with its type optionally followed by
+// a tpl image with its body, or a single binary frame.
+struct conn {
+	int sock;
+	struct frame_buffer in;
+
+	// type of the message whose body is expected next, -1 if none
+	int body_type;
+
+	// see conn_delta_base
+	struct response *delta_base;
+
+	// see conn_kept_buffers
+	struct kept_buffer *kept;
+
+	// guarded by 'conns_lock'
+	int busy;
+	int closed;
+	struct job *current;
+	struct job *pending_head;
+	struct job *pending_tail;
+	struct conn *next;
+};
+
+// for reference
+static struct conn *new_conn(int sock);
+static void free_conn(struct conn *c);
+static void accept_conn(int sock);
+static void read_conn(struct conn *c);
+static void close_conn(struct conn *c);
+static int handle_frame(struct conn *c, const char *frame, size_t size);
+static int handle_image(struct conn *c, void *img, size_t sz);
+static struct job *new_job(struct conn *c, int msg_type, void *img, size_t sz);
+static void free_job(struct job *job);
+static void queue_job(struct job *job);
+static void supersede_jobs(struct conn *c, const char *filename);
+static void cancel_if_same_file(struct job *job, const char *filename);
+static int set_nonblocking(int fd);
+
+//-------------------------------------------------------------------------
+
+#define AUTO_SHUTDOWN_TIME 15
+#define MAX_EVENTS 32
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn *conns;
+static int conns_n;
+
+static int epfd;
+static int quit;
+
+static struct conn *new_conn(int sock)
+{
+	struct conn *c = calloc(1, sizeof(struct conn));
+	c->sock = sock;
+	c->body_type = -1;
+
+	pthread_mutex_lock(&conns_lock);
+	c->next = conns;
+	conns = c;
+	conns_n++;
+	pthread_mutex_unlock(&conns_lock);
+	return c;
+}
+
+// expects 'conns_lock' to be held
+static void free_conn(struct conn *c)
+{
+	struct conn **pc = &conns;
+	while (*pc != c)
+		pc = &(*pc)->next;
+	*pc = c->next;
+	conns_n--;
+
+	while (c->pending_head) {
+		struct job *job = c->pending_head;
+		c->pending_head = job->next;
+		free_job(job);
+	}
+	free_frame_buffer(&c->in);
+	if (c->delta_base)
+		response_unref(c->delta_base);
+	free_kept_buffers(c->kept);
+	close(c->sock);
+	free(c);
+}
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void accept_conn(int sock)
+{
+	struct epoll_event ev;
+	struct conn *c;
+	int incoming;
+
+	incoming = accept(sock, 0, 0);
+	if (incoming == -1) {
+		fprintf(stderr, "Error! Failed to accept an incoming connection.\n");
+		return;
+	}
+
+	if (set_nonblocking(incoming) == -1 || set_cloexec(incoming) == -1) {
+		close(incoming);
+		return;
+	}
+
+	c = new_conn(incoming);
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, incoming, &ev) == -1) {
+		pthread_mutex_lock(&conns_lock);
+		free_conn(c);
+		pthread_mutex_unlock(&conns_lock);
+	}
+}
+
+// Stops reading from the connection. It's freed right away unless a worker
+// is busy with it, responses to the rest of the messages are written anyway.
+static void close_conn(struct conn *c)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, 0);
+
+	pthread_mutex_lock(&conns_lock);
+	c->closed = 1;
+	if (!c->busy)
+		free_conn(c);
+	pthread_mutex_unlock(&conns_lock);
+}
+
+// Reads whatever there is and handles complete frames, the rest waits for
+// the next time.
+static void read_conn(struct conn *c)
+{
+	const char *frame;
+	size_t size;
+	int rc;
+
+	ssize_t n = frame_read(&c->in, c->sock);
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		close_conn(c);
+		return;
+	}
+
+	while ((rc = frame_next(&c->in, &frame, &size)) == 1) {
+		if (handle_frame(c, frame, size) == -1) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc == -1)
+		close_conn(c);
+}
+
+// binary frames are MSG_AC only, everything else is a tpl image
+static int handle_frame(struct conn *c, const char *frame, size_t size)
+{
+	struct job *job;
+
+	if (memcmp(frame, "tpl", 3) == 0)
+		return handle_image(c, (void*)frame, size);
+	if (c->body_type != -1)
+		return -1;
+
+	job = calloc(1, sizeof(struct job));
+	job->conn = c;
+	job->sock = c->sock;
+	job->msg_type = MSG_AC;
+	job->binary = 1;
+	if (msg_ac_from_bin(&job->msg.ac, frame, size) == -1) {
+		free(job);
+		return -1;
+	}
+	queue_job(job);
+	return 0;
+}
+
+static int handle_image(struct conn *c, void *img, size_t sz)
+{
+	struct job *job;
+	int msg_type;
+	tpl_node *tn;
+
+	if (c->body_type != -1) {
+		job = new_job(c, c->body_type, img, sz);
+		c->body_type = -1;
+		if (!job)
+			return -1;
+		queue_job(job);
+		return 0;
+	}
+
+	tn = tpl_map("i", &msg_type);
+	if (tpl_load(tn, TPL_MEM, img, sz) == -1) {
+		tpl_free(tn);
+		return -1;
+	}
+	tpl_unpack(tn, 0);
+	tpl_free(tn);
+
+	switch (msg_type) {
+	case MSG_CLOSE:
+		quit = 1;
+		return 0;
+	case MSG_STATS:
+	case MSG_VERSION:
+		queue_job(new_job(c, msg_type, 0, 0));
+		return 0;
+	case MSG_AC:
+	case MSG_AC_MORE:
+	case MSG_OPEN:
+	case MSG_RESOLVE:
+		c->body_type = msg_type;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+// unpacks the body image, if there is one, zero if it's malformed
+static struct job *new_job(struct conn *c, int msg_type, void *img, size_t sz)
+{
+	struct job *job = calloc(1, sizeof(struct job));
+	tpl_node *tn = 0;
+
+	job->conn = c;
+	job->sock = c->sock;
+	job->msg_type = msg_type;
+
+	switch (msg_type) {
+	case MSG_AC:
+		tn = msg_ac_node(&job->msg.ac);
+		break;
+	case MSG_AC_MORE:
+		tn = msg_ac_more_node(&job->msg.more);
+		break;
+	case MSG_OPEN:
+		tn = msg_open_node(&job->msg.open);
+		break;
+	case MSG_RESOLVE:
+		tn = msg_resolve_node(&job->msg.resolve);
+		break;
+	}
+	if (tn) {
+		if (tpl_load(tn, TPL_MEM, img, sz) == -1) {
+			tpl_free(tn);
+			free(job);
+			return 0;
+		}
+		tpl_unpack(tn, 0);
+		tpl_free(tn);
+	}
+	return job;
+}
+
+static void free_job(struct job *job)
+{
+	switch (job->msg_type) {
+	case MSG_AC:
+		free_msg_ac(&job->msg.ac);
+		break;
+	case MSG_OPEN:
+		free_msg_open(&job->msg.open);
+		break;
+	case MSG_RESOLVE:
+		free_msg_resolve(&job->msg.resolve);
+		break;
+	}
+	free(job);
+}
+
+static void cancel_if_same_file(struct job *job, const char *filename)
+{
+	if (job->msg_type != MSG_AC || job->cancelled)
+		return;
+	if (strcmp(job->msg.ac.filename, filename) != 0)
+		return;
+	job->cancelled = 1;
+	STATS_INC(cancelled);
+}
+
+// Only requests on the same connection are superseded, there is no telling
+// whether two connections belong to the same editor. So only clients which
+// send the next request without waiting for the response to the last one
+// get anything out of it. 'ccode pipe' and with it the vim plugin always
+// wait, vim's omnifunc has to return the results.
+//
+// expects 'conns_lock' to be held
+static void supersede_jobs(struct conn *c, const char *filename)
+{
+	if (c->current)
+		cancel_if_same_file(c->current, filename);
+	for (struct job *job = c->pending_head; job; job = job->next)
+		cancel_if_same_file(job, filename);
+}
+
+static void queue_job(struct job *job)
+{
+	struct conn *c = job->conn;
+
+	// nobody waits for a response to MSG_OPEN, it doesn't have to hold
+	// up the messages which follow it
+	if (job->msg_type == MSG_OPEN) {
+		job->conn = 0;
+		job->sock = -1;
+		workers_push(job);
+		return;
+	}
+
+	pthread_mutex_lock(&conns_lock);
+	if (job->msg_type == MSG_AC)
+		supersede_jobs(c, job->msg.ac.filename);
+
+	if (c->busy) {
+		if (c->pending_tail)
+			c->pending_tail->next = job;
+		else
+			c->pending_head = job;
+		c->pending_tail = job;
+		job = 0;
+	} else {
+		c->busy = 1;
+		c->current = job;
+	}
+	pthread_mutex_unlock(&conns_lock);
+
+	if (job)
+		workers_push(job);
+}
+
+void conn_job_done(struct job *job)
+{
+	struct conn *c = job->conn;
+	struct job *next = 0;
+
+	free_job(job);
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&conns_lock);
+	c->current = 0;
+	if (c->pending_head) {
+		next = c->pending_head;
+		c->pending_head = next->next;
+		if (!c->pending_head)
+			c->pending_tail = 0;
+		c->current = next;
+	} else {
+		c->busy = 0;
+		if (c->closed)
+			free_conn(c);
+	}
+	pthread_mutex_unlock(&conns_lock);
+
+	if (next)
+		workers_push(next);
+}
+
+void conn_loop(int sock)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	int minutes_idle = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		fprintf(stderr, "Error! Failed to create an epoll instance.\n");
+		exit(1);
+	}
+
+	// the listening socket is the only one with a zero pointer
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+
+	while (!quit) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, 60 * 1000);
+		if (n == -1)
+			continue;
+		if (!n) {
+			// editors with an open connection keep the server alive
+			pthread_mutex_lock(&conns_lock);
+			if (!conns_n)
+				minutes_idle++;
+			pthread_mutex_unlock(&conns_lock);
+			if (minutes_idle >= AUTO_SHUTDOWN_TIME)
+				break;
+			continue;
+		}
+
+		minutes_idle = 0;
+		for (int i = 0; i < n; ++i) {
+			struct conn *c = events[i].data.ptr;
+			if (!c)
+				accept_conn(sock);
+			else
+				read_conn(c);
+		}
+	}
+
+	close(epfd);
+}
+
+struct response **conn_delta_base(struct conn *c)
+{
+	return &c->delta_base;
+}
+
+struct kept_buffer **conn_kept_buffers(struct conn *c)
+{
+	return &c->kept;
+}
+
+void conn_free_all()
+{
+	pthread_mutex_lock(&conns_lock);
+	while (conns)
+		free_conn(conns);
+	pthread_mutex_unlock(&conns_lock);
+}
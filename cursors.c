@@ -0,0 +1,186 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The rest of a paged response. It's taken out of the list while its page
+// is being sent, so two requests never get the same page.
+struct cursor {
+	int id;
+	struct response *response;
+	uint32_t sent; // how many proposals
+
+	// guarded by the cursors lock
+	time_t last_used;
+	struct cursor *next;
+};
+
+// for reference
+static int send_page(struct cursor *c, int page, int binary, int sock);
+static void drop_expired(time_t now);
+static struct cursor *take_cursor(int id);
+static void put_cursor(struct cursor *c);
+static void free_cursor(struct cursor *c);
+
+//-------------------------------------------------------------------------
+
+static pthread_mutex_t cursors_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cursor *cursors;
+static int cursors_n;
+static int cursor_ttl;
+static int last_id;
+
+void cursors_init(int ttl)
+{
+	cursor_ttl = ttl;
+}
+
+void cursors_free()
+{
+	while (cursors) {
+		struct cursor *c = cursors;
+		cursors = c->next;
+		free_cursor(c);
+	}
+	cursors_n = 0;
+}
+
+static void free_cursor(struct cursor *c)
+{
+	response_unref(c->response);
+	free(c);
+}
+
+// Sends up to 'page' proposals from where the cursor is and moves it past
+// them, returns 1 if there are more.
+static int send_page(struct cursor *c, int page, int binary, int sock)
+{
+	struct bin_ac_response h;
+	struct bin_proposals p;
+	uint32_t first = c->sent;
+
+	bin_ac_response_get(c->response->data, &h, &p);
+	if (page <= 0 || (uint32_t)page > p.n - first)
+		page = p.n - first;
+	c->sent += page;
+
+	ac_response_send_part(c->response->data, first, page,
+			      (c->sent < p.n) ? c->id : 0, binary, sock);
+	return c->sent < p.n;
+}
+
+void send_first_page(struct response *r, int page, int binary, int sock)
+{
+	struct bin_ac_response h;
+	struct bin_proposals p;
+	struct cursor *c;
+
+	// everything fits, the response goes as it is
+	bin_ac_response_get(r->data, &h, &p);
+	if (page <= 0 || p.n <= (uint32_t)page) {
+		ac_response_send(r->data, r->size, binary, sock);
+		return;
+	}
+
+	c = malloc(sizeof(struct cursor));
+	c->id = __sync_add_and_fetch(&last_id, 1);
+	c->response = response_ref(r);
+	c->sent = 0;
+	send_page(c, page, binary, sock);
+	put_cursor(c);
+}
+
+void send_stream(struct response *r, uint32_t first, int page, int binary,
+		 int sock)
+{
+	struct bin_ac_response h;
+	struct bin_proposals p;
+	struct cursor c = { .id = AC_STREAMED, .response = r };
+
+	bin_ac_response_get(r->data, &h, &p);
+	c.sent = (first < p.n) ? first : p.n;
+	while (send_page(&c, page, binary, sock))
+		;
+}
+
+void send_next_page(int cursor, int page, int sock)
+{
+	struct cursor *c = take_cursor(cursor);
+
+	if (!c) {
+		struct bin_proposals p;
+		char *frame;
+		size_t size;
+
+		frame = bin_ac_response_new(&size, &p, AC_CANCELLED, 0, 0, 0,
+					    0);
+		ac_response_send(frame, size, 0, sock);
+		free(frame);
+		return;
+	}
+
+	if (send_page(c, page, 0, sock))
+		put_cursor(c);
+	else
+		free_cursor(c);
+}
+
+// expects 'cursors_lock' to be held
+static void drop_expired(time_t now)
+{
+	struct cursor **pc = &cursors;
+
+	while (*pc) {
+		struct cursor *c = *pc;
+		if (now - c->last_used > cursor_ttl) {
+			*pc = c->next;
+			cursors_n--;
+			free_cursor(c);
+		} else {
+			pc = &c->next;
+		}
+	}
+}
+
+static struct cursor *take_cursor(int id)
+{
+	struct cursor **pc, *c = 0;
+
+	pthread_mutex_lock(&cursors_lock);
+	drop_expired(time(0));
+	for (pc = &cursors; *pc; pc = &(*pc)->next) {
+		if ((*pc)->id == id) {
+			c = *pc;
+			*pc = c->next;
+			cursors_n--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cursors_lock);
+	return c;
+}
+
+static void put_cursor(struct cursor *c)
+{
+	struct cursor **evicted = 0;
+	time_t now = time(0);
+
+	pthread_mutex_lock(&cursors_lock);
+	drop_expired(now);
+	if (cursors_n >= MAX_CURSORS) {
+		for (struct cursor **pc = &cursors; *pc; pc = &(*pc)->next) {
+			if (!evicted || (*pc)->last_used < (*evicted)->last_used)
+				evicted = pc;
+		}
+		struct cursor *e = *evicted;
+		*evicted = e->next;
+		cursors_n--;
+		free_cursor(e);
+	}
+
+	c->last_used = now;
+	c->next = cursors;
+	cursors = c;
+	cursors_n++;
+	pthread_mutex_unlock(&cursors_lock);
+}
@@ -0,0 +1,124 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+
+// for reference
+static uint64_t proposal_hash(struct bin_proposals *p, uint32_t i);
+static int proposal_eq(struct bin_proposals *p, uint32_t i,
+		       struct bin_proposals *bp, uint32_t j);
+
+//-------------------------------------------------------------------------
+
+// its strings, its count and its id
+static uint64_t proposal_hash(struct bin_proposals *p, uint32_t i)
+{
+	uint64_t h = hash_bytes(HASH_INIT, p->strings + p->words[i],
+				bin_proposal_end(p, i) - p->words[i]);
+	h = hash_bytes(h, &p->counts[i], sizeof(int32_t));
+	return hash_bytes(h, &p->ids[i], sizeof(int32_t));
+}
+
+static int proposal_eq(struct bin_proposals *p, uint32_t i,
+		       struct bin_proposals *bp, uint32_t j)
+{
+	uint32_t len = bin_proposal_end(p, i) - p->words[i];
+
+	return bin_proposal_end(bp, j) - bp->words[j] == len &&
+		p->abbrs[i] - p->words[i] == bp->abbrs[j] - bp->words[j] &&
+		p->counts[i] == bp->counts[j] && p->ids[i] == bp->ids[j] &&
+		memcmp(p->strings + p->words[i], bp->strings + bp->words[j],
+		       len) == 0;
+}
+
+// Proposals are compared as they are in the frame, a proposal whose abbr
+// or count has changed is sent again.
+void send_delta(struct response *r, struct response **base, int binary,
+		int sock)
+{
+	struct bin_ac_response h, bh;
+	struct bin_proposals p, bp, np;
+	uint32_t new_n = 0, mask = 0;
+	int32_t *slots = 0, *refs, *dst_refs;
+	size_t new_size = 0, size;
+	char *frame, *dst;
+
+	bin_ac_response_get(r->data, &h, &p);
+	if (*base) {
+		bin_ac_response_get((*base)->data, &bh, &bp);
+
+		// open addressing, at most half full
+		for (mask = 1; mask < 2 * bp.n; mask <<= 1)
+			;
+		slots = malloc(sizeof(int32_t) * mask--);
+		memset(slots, 0xff, sizeof(int32_t) * (mask + 1));
+		for (uint32_t j = 0; j < bp.n; j++) {
+			uint32_t s = proposal_hash(&bp, j) & mask;
+			while (slots[s] != -1)
+				s = (s + 1) & mask;
+			slots[s] = j;
+		}
+	}
+
+	refs = malloc(sizeof(int32_t) * p.n);
+	for (uint32_t i = 0; i < p.n; i++) {
+		refs[i] = -1;
+		if (slots) {
+			uint32_t s = proposal_hash(&p, i) & mask;
+			for (; slots[s] != -1; s = (s + 1) & mask) {
+				if (proposal_eq(&p, i, &bp, slots[s])) {
+					refs[i] = slots[s];
+					break;
+				}
+			}
+		}
+		if (refs[i] == -1) {
+			new_n++;
+			new_size += bin_proposal_end(&p, i) - p.words[i];
+		}
+	}
+
+	frame = bin_ac_delta_response_new(&size, &dst_refs, &np, h.partial,
+					  h.truncated, p.n, new_n, new_size);
+	memcpy(dst_refs, refs, sizeof(int32_t) * p.n);
+	dst = np.strings;
+	for (uint32_t i = 0, k = 0; i < p.n; i++) {
+		uint32_t len = bin_proposal_end(&p, i) - p.words[i];
+
+		if (refs[i] != -1)
+			continue;
+		np.words[k] = dst - np.strings;
+		np.abbrs[k] = np.words[k] + (p.abbrs[i] - p.words[i]);
+		np.counts[k] = p.counts[i];
+		np.ids[k] = p.ids[i];
+		memcpy(dst, p.strings + p.words[i], len);
+		dst += len;
+		k++;
+	}
+	ac_delta_response_send(frame, size, binary, sock);
+
+	free(frame);
+	free(refs);
+	free(slots);
+	if (*base)
+		response_unref(*base);
+	*base = response_ref(r);
+}
+
+void send_empty_delta(int partial, struct response **base, int binary,
+		      int sock)
+{
+	struct bin_proposals p;
+	int32_t *refs;
+	char *frame;
+	size_t size;
+
+	frame = bin_ac_delta_response_new(&size, &refs, &p, partial, 0, 0, 0,
+					  0);
+	ac_delta_response_send(frame, size, binary, sock);
+	free(frame);
+
+	if (partial >= 0 && *base) {
+		response_unref(*base);
+		*base = 0;
+	}
+}
@@ -0,0 +1,107 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A buffer kept for AC_EDIT, lists of them start with the most recently used
+// one.
+struct kept_buffer {
+	char *filename;
+	char *data;
+	size_t size;
+	struct kept_buffer *next;
+};
+
+// for reference
+static struct kept_buffer *take_kept(struct kept_buffer **kept,
+				     const char *filename);
+static void put_kept(struct kept_buffer **kept, struct kept_buffer *k);
+static int apply(struct kept_buffer *k, struct msg_ac *msg);
+
+//-------------------------------------------------------------------------
+
+void free_kept_buffers(struct kept_buffer *kept)
+{
+	while (kept) {
+		struct kept_buffer *k = kept;
+		kept = k->next;
+		free(k->filename);
+		free(k->data);
+		free(k);
+	}
+}
+
+static struct kept_buffer *take_kept(struct kept_buffer **kept,
+				     const char *filename)
+{
+	for (struct kept_buffer **pk = kept; *pk; pk = &(*pk)->next) {
+		struct kept_buffer *k = *pk;
+		if (strcmp(k->filename, filename) == 0) {
+			*pk = k->next;
+			k->next = 0;
+			return k;
+		}
+	}
+	return 0;
+}
+
+// puts 'k' first, the last ones go if there are too many
+static void put_kept(struct kept_buffer **kept, struct kept_buffer *k)
+{
+	struct kept_buffer **pk = &k->next;
+
+	k->next = *kept;
+	*kept = k;
+	for (int n = 1; *pk; n++, pk = &(*pk)->next) {
+		if (n == MAX_KEPT_BUFFERS) {
+			free_kept_buffers(*pk);
+			*pk = 0;
+			break;
+		}
+	}
+}
+
+// The job gets a copy of the edited buffer, the kept one changes with the
+// next edit.
+static int apply(struct kept_buffer *k, struct msg_ac *msg)
+{
+	if (replace_lines(&k->data, &k->size, msg->edit_start, msg->edit_end,
+			  msg->buffer.addr, msg->buffer.sz) == -1)
+		return -1;
+	if (hash_bytes(HASH_INIT, k->data, k->size) != msg->hash)
+		return -1;
+
+	free(msg->buffer.addr);
+	msg->buffer.addr = malloc(k->size);
+	msg->buffer.sz = k->size;
+	memcpy(msg->buffer.addr, k->data, k->size);
+	return 0;
+}
+
+int apply_edit(struct kept_buffer **kept, struct msg_ac *msg)
+{
+	struct kept_buffer *k = take_kept(kept, msg->filename);
+
+	if (msg->flags & AC_EDIT) {
+		if (!k || apply(k, msg) == -1) {
+			free_kept_buffers(k);
+			return -1;
+		}
+		put_kept(kept, k);
+		return 0;
+	}
+
+	if (!(msg->flags & AC_KEEP)) {
+		free_kept_buffers(k);
+		return 0;
+	}
+
+	if (!k) {
+		k = calloc(1, sizeof(struct kept_buffer));
+		k->filename = strdup(msg->filename);
+	}
+	k->data = realloc(k->data, msg->buffer.sz);
+	k->size = msg->buffer.sz;
+	memcpy(k->data, msg->buffer.addr, msg->buffer.sz);
+	put_kept(kept, k);
+	return 0;
+}
@@ -5,6 +5,8 @@ int main(int argc, char **argv)
 {
 	if (argc > 1 && strcmp("-s", argv[1]) == 0) {
 		server_main();
+	} else if (argc == 4 && strcmp("-expand", argv[1]) == 0) {
+		return expand_main(argv[2], argv[3]);
 	} else {
 		client_main(argc, argv);
 	}
@@ -1,8 +1,12 @@
 #include "shared.h"
 #include <sys/stat.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 int file_exists(const char *filename)
 {
@@ -35,6 +39,7 @@ int read_file(void **out, size_t *size, const char *filename)
 		return -1;
 	}
 
+	fclose(f);
 	return 0;
 }
 
@@ -65,6 +70,105 @@ int read_stdin(void **out, size_t *size)
 	return 0;
 }
 
+int write_all(int fd, const void *buf, size_t size)
+{
+	const char *c = buf;
+
+	while (size) {
+		ssize_t n = write(fd, c, size);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		c += n;
+		size -= n;
+	}
+	return 0;
+}
+
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		// skip what's written, the rest goes with the next writev
+		while (iovcnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+int set_cloexec(int fd)
+{
+	int flags = fcntl(fd, F_GETFD, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+// offset of the start of 'line', -1 if there are fewer lines, the end of the
+// buffer ends the last line if there is no newline there
+static ssize_t line_offset(const char *data, size_t size, int line)
+{
+	const char *p = data;
+	const char *end = data + size;
+
+	for (; line > 0; line--) {
+		const char *nl = memchr(p, '\n', end - p);
+		if (!nl)
+			return (line == 1 && p < end) ? (ssize_t)size : -1;
+		p = nl + 1;
+	}
+	return p - data;
+}
+
+int replace_lines(char **data, size_t *size, int start, int end,
+		  const char *text, size_t text_size)
+{
+	ssize_t from, to;
+	size_t new_size;
+
+	if (start < 0 || end < start)
+		return -1;
+	from = line_offset(*data, *size, start);
+	if (from == -1)
+		return -1;
+	to = line_offset(*data + from, *size - from, end - start);
+	if (to == -1)
+		return -1;
+	to += from;
+
+	new_size = from + text_size + (*size - to);
+	if (new_size > *size)
+		*data = realloc(*data, new_size);
+	memmove(*data + from + text_size, *data + to, *size - to);
+	memcpy(*data + from, text, text_size);
+	*size = new_size;
+	return 0;
+}
+
 str_t *get_socket_path()
 {
 	char *user = getenv("USER");
@@ -73,3 +177,26 @@ str_t *get_socket_path()
 	else
 		return str_from_cstr("/tmp/ccode-server");
 }
+
+int env_int(const char *name, int def)
+{
+	char *end;
+	char *value = getenv(name);
+	if (!value || !*value)
+		return def;
+
+	long v = strtol(value, &end, 10);
+	if (*end != '\0')
+		return def;
+	return (int)v;
+}
+
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *c = data;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= c[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
@@ -0,0 +1,134 @@
+#include "server.h"
+#include <stdlib.h>
+
+// A parallel_for call. It lives on the caller's stack, helpers take chunks
+// from it until there are none left.
+struct task {
+	void (*fn)(void *ctx, unsigned int chunk);
+	void *ctx;
+	unsigned int chunks_n;
+	unsigned int next_chunk; // atomic
+
+	// guarded by 'pool_lock'
+	int helpers;
+	struct task *next;
+};
+
+// for reference
+static void *helper_main(void *unused);
+static void run_chunks(struct task *t);
+static void unlink_task(struct task *t);
+
+//-------------------------------------------------------------------------
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t helpers_cond = PTHREAD_COND_INITIALIZER;
+static struct task *tasks;
+static int stopping;
+
+static pthread_t *threads;
+static int threads_n;
+
+void pool_start(int n)
+{
+	// the calling thread always helps, it's one of 'n'
+	if (n < 2)
+		return;
+
+	threads = malloc(sizeof(pthread_t) * (n - 1));
+	for (threads_n = 0; threads_n < n - 1; threads_n++) {
+		if (pthread_create(&threads[threads_n], 0, helper_main, 0) != 0)
+			break;
+	}
+}
+
+void pool_stop()
+{
+	pthread_mutex_lock(&pool_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&task_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (int i = 0; i < threads_n; ++i)
+		pthread_join(threads[i], 0);
+	free(threads);
+	threads = 0;
+	threads_n = 0;
+}
+
+int pool_size()
+{
+	return threads_n + 1;
+}
+
+static void run_chunks(struct task *t)
+{
+	unsigned int chunk;
+	while ((chunk = __sync_fetch_and_add(&t->next_chunk, 1)) < t->chunks_n)
+		(*t->fn)(t->ctx, chunk);
+}
+
+// expects 'pool_lock' to be held
+static void unlink_task(struct task *t)
+{
+	struct task **pt = &tasks;
+	while (*pt && *pt != t)
+		pt = &(*pt)->next;
+	if (*pt)
+		*pt = t->next;
+}
+
+static void *helper_main(void *unused)
+{
+	pthread_mutex_lock(&pool_lock);
+	while (!stopping) {
+		struct task *t = tasks;
+		if (!t) {
+			pthread_cond_wait(&task_cond, &pool_lock);
+			continue;
+		}
+
+		// everything is taken, the owner is going to finish it
+		if (t->next_chunk >= t->chunks_n) {
+			unlink_task(t);
+			continue;
+		}
+
+		t->helpers++;
+		pthread_mutex_unlock(&pool_lock);
+		run_chunks(t);
+		pthread_mutex_lock(&pool_lock);
+		if (--t->helpers == 0)
+			pthread_cond_broadcast(&helpers_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+void parallel_for(unsigned int chunks_n,
+		  void (*fn)(void *ctx, unsigned int chunk), void *ctx)
+{
+	struct task t = { fn, ctx, chunks_n, 0, 0, 0 };
+
+	if (!threads_n || chunks_n < 2) {
+		for (unsigned int i = 0; i < chunks_n; i++)
+			(*fn)(ctx, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	t.next = tasks;
+	tasks = &t;
+	pthread_cond_broadcast(&task_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	run_chunks(&t);
+
+	// all chunks are taken, wait for the helpers still working on theirs
+	pthread_mutex_lock(&pool_lock);
+	unlink_task(&t);
+	while (t.helpers)
+		pthread_cond_wait(&helpers_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,427 @@
+#include "server.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <wordexp.h>
+
+extern char **environ;
+
+// A directory which may contain a .ccode file, everything needed to serve
+// files from it. Entries live until the server quits, their number is bounded
+// by the number of directories ever seen.
+struct project {
+	char *dir;
+
+	// guarded by 'projects_lock'
+	struct flags *flags;
+	int has_dotccode;
+	struct timespec mtime;
+	off_t size;
+	time_t expanded_at;
+	int refreshing;
+	struct project *next;
+};
+
+// for reference
+static struct flags *expand_flags(const char *dir);
+static int expand_in_child(char **out, size_t *size, const char *words,
+			   const char *dir);
+static char *absolute_to(const char *dir, const char *path);
+static void resolve_paths(struct flags *f, const char *dir);
+static struct project *find_project(const char *dir);
+static int dotccode_unchanged(struct project *p, int has_dotccode,
+			      struct stat *st);
+static void set_flags(struct project *p, struct flags *f, int has_dotccode,
+		      struct stat *st);
+static void queue_refresh(struct project *p);
+
+//-------------------------------------------------------------------------
+
+static pthread_mutex_t projects_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct project *projects;
+static int flags_ttl;
+
+void projects_init(int ttl)
+{
+	flags_ttl = ttl;
+}
+
+void projects_free()
+{
+	while (projects) {
+		struct project *p = projects;
+		projects = p->next;
+		if (p->flags)
+			flags_unref(p->flags);
+		free(p->dir);
+		free(p);
+	}
+}
+
+struct flags *flags_ref(struct flags *f)
+{
+	__sync_fetch_and_add(&f->refs, 1);
+	return f;
+}
+
+void flags_unref(struct flags *f)
+{
+	if (__sync_sub_and_fetch(&f->refs, 1) != 0)
+		return;
+
+	for (int i = 0; i < f->argc; i++)
+		free(f->argv[i]);
+	free(f->argv);
+	free(f);
+}
+
+int flags_equal(struct flags *a, struct flags *b)
+{
+	if (a == b)
+		return 1;
+	if (a->argc != b->argc)
+		return 0;
+
+	for (int i = 0; i < a->argc; i++) {
+		if (strcmp(a->argv[i], b->argv[i]) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+// options followed by a path, either as the next argument or glued to it
+static const struct path_option {
+	const char *name;
+	int joined;
+} path_options[] = {
+	{"-I", 1},
+	{"-F", 1},
+	{"-iquote", 1},
+	{"-isystem", 1},
+	{"-idirafter", 1},
+	{"-iframework", 1},
+	{"-isysroot", 1},
+	{"--sysroot=", 1},
+	{"--sysroot", 0},
+	{"-include", 0},
+	{"-imacros", 0},
+	{"-include-pch", 0},
+	{"-ivfsoverlay", 0},
+};
+
+// Runs .ccode through wordexp in a 'ccode -expand' process, see
+// expand_main. It's spawned rather than forked off, the server is
+// multithreaded and a forked child could only call async-signal-safe
+// functions. Descriptors of the server are close-on-exec, the child gets only
+// the pipe. Words come back separated by '\0'. Returns the number of words
+// or -1 on failure.
+static int expand_in_child(char **out, size_t *size, const char *words,
+			   const char *dir)
+{
+	posix_spawn_file_actions_t actions;
+	size_t cap = 1024;
+	int status, n = 0;
+	int fds[2];
+	char *argv[] = { "ccode", "-expand", (char*)dir, (char*)words, 0 };
+	pid_t pid;
+
+	if (pipe(fds) == -1)
+		return -1;
+	set_cloexec(fds[0]);
+	set_cloexec(fds[1]);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+	status = posix_spawn(&pid, "/proc/self/exe", &actions, 0, argv,
+			     environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+	if (status != 0) {
+		close(fds[0]);
+		return -1;
+	}
+
+	*out = malloc(cap);
+	*size = 0;
+	while (1) {
+		ssize_t r;
+		if (*size == cap) {
+			cap *= 2;
+			*out = realloc(*out, cap);
+		}
+		r = read(fds[0], *out + *size, cap - *size);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		*size += r;
+	}
+	close(fds[0]);
+
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		free(*out);
+		return -1;
+	}
+
+	for (size_t i = 0; i < *size; i++) {
+		if ((*out)[i] == '\0')
+			n++;
+	}
+	return n;
+}
+
+int expand_main(const char *dir, const char *words)
+{
+	wordexp_t wexp;
+
+	if (chdir(dir) == -1 || wordexp(words, &wexp, 0) != 0)
+		return 1;
+	for (size_t i = 0; i < wexp.we_wordc; i++) {
+		const char *w = wexp.we_wordv[i];
+		if (write_all(1, w, strlen(w) + 1) == -1)
+			return 1;
+	}
+	wordfree(&wexp);
+	return 0;
+}
+
+static char *absolute_to(const char *dir, const char *path)
+{
+	str_t *abs = str_from_cstr(dir);
+	char *ret;
+
+	str_add_cstr(&abs, "/");
+	str_add_cstr(&abs, path);
+	ret = strdup(abs->data);
+	str_free(abs);
+	return ret;
+}
+
+// Makes paths given to the options from 'path_options' absolute, so that
+// flags mean the same thing regardless of the server's cwd.
+static void resolve_paths(struct flags *f, const char *dir)
+{
+	for (int i = 0; i < f->argc; i++) {
+		const char *arg = f->argv[i];
+		size_t n = sizeof(path_options) / sizeof(path_options[0]);
+
+		for (size_t j = 0; j < n; j++) {
+			const struct path_option *o = &path_options[j];
+			size_t len = strlen(o->name);
+
+			if (strcmp(arg, o->name) == 0) {
+				// the path is the next argument
+				i++;
+				if (i < f->argc && f->argv[i][0] != '/') {
+					char *abs = absolute_to(dir, f->argv[i]);
+					free(f->argv[i]);
+					f->argv[i] = abs;
+				}
+				break;
+			}
+			if (o->joined && strncmp(arg, o->name, len) == 0) {
+				if (arg[len] != '/') {
+					str_t *tmp = str_from_cstr_len(arg, len);
+					str_add_cstr(&tmp, dir);
+					str_add_cstr(&tmp, "/");
+					str_add_cstr(&tmp, arg + len);
+					free(f->argv[i]);
+					f->argv[i] = strdup(tmp->data);
+					str_free(tmp);
+				}
+				break;
+			}
+		}
+	}
+}
+
+// Reads .ccode and runs it through the shell, which may take a while if it
+// calls pkg-config and friends. Done only when the file changes and once per
+// TTL in the background.
+static struct flags *expand_flags(const char *dir)
+{
+	struct flags *f = calloc(1, sizeof(struct flags));
+	char *path, *words = 0;
+	void *buf;
+	size_t size;
+	int n = -1;
+
+	f->refs = 1;
+
+	path = absolute_to(dir, ".ccode");
+	if (read_file(&buf, &size, path) == 0) {
+		str_t *contents = str_from_cstr_len(buf, (unsigned int)size);
+		str_trim(contents);
+		free(buf);
+		// wordexp rejects line breaks, flags may span lines
+		for (char *c = contents->data; *c; c++) {
+			if (*c == '\n')
+				*c = ' ';
+		}
+		n = expand_in_child(&words, &size, contents->data, dir);
+		str_free(contents);
+	}
+	free(path);
+
+	if (n == -1) {
+		f->argv = calloc(1, sizeof(char*));
+		return f;
+	}
+
+	f->argc = n;
+	f->argv = malloc(sizeof(char*) * (f->argc + 1));
+	char *w = words;
+	for (int i = 0; i < n; i++, w += strlen(w) + 1)
+		f->argv[i] = strdup(w);
+	f->argv[f->argc] = 0;
+	free(words);
+
+	resolve_paths(f, dir);
+	return f;
+}
+
+// expects 'projects_lock' to be held
+static struct project *find_project(const char *dir)
+{
+	for (struct project *p = projects; p; p = p->next) {
+		if (strcmp(p->dir, dir) == 0)
+			return p;
+	}
+	return 0;
+}
+
+// expects 'projects_lock' to be held
+static int dotccode_unchanged(struct project *p, int has_dotccode,
+			      struct stat *st)
+{
+	if (p->has_dotccode != has_dotccode)
+		return 0;
+	if (!has_dotccode)
+		return 1;
+	return p->size == st->st_size &&
+	       p->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       p->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// expects 'projects_lock' to be held, takes ownership of 'f'
+static void set_flags(struct project *p, struct flags *f, int has_dotccode,
+		      struct stat *st)
+{
+	// keep the old vector if nothing has changed, cached TUs are matched
+	// by flags and comparing pointers is the cheapest way to do that
+	if (p->flags && flags_equal(p->flags, f)) {
+		flags_unref(f);
+	} else {
+		if (p->flags)
+			flags_unref(p->flags);
+		p->flags = f;
+	}
+
+	p->has_dotccode = has_dotccode;
+	if (has_dotccode) {
+		p->mtime = st->st_mtim;
+		p->size = st->st_size;
+	}
+	p->expanded_at = time(0);
+}
+
+// expects 'projects_lock' to be held
+static void queue_refresh(struct project *p)
+{
+	struct job *job = calloc(1, sizeof(struct job));
+
+	job->sock = -1;
+	job->msg_type = JOB_REFRESH_FLAGS;
+	job->msg.project = p;
+	p->refreshing = 1;
+	workers_push(job);
+}
+
+void project_refresh(struct project *p)
+{
+	struct stat st;
+	struct flags *f;
+	str_t *path;
+	int has_dotccode;
+
+	path = str_from_cstr(p->dir);
+	str_add_cstr(&path, "/.ccode");
+	has_dotccode = stat(path->data, &st) == 0;
+	str_free(path);
+
+	f = expand_flags(p->dir);
+
+	pthread_mutex_lock(&projects_lock);
+	set_flags(p, f, has_dotccode, &st);
+	p->refreshing = 0;
+	pthread_mutex_unlock(&projects_lock);
+}
+
+struct project *project_get(const char *filename)
+{
+	struct project *p;
+	str_t *dir, *fn;
+
+	fn = str_from_cstr(filename);
+	dir = str_split_path(fn, 0);
+	if (!dir)
+		dir = str_from_cstr("/");
+
+	pthread_mutex_lock(&projects_lock);
+	p = find_project(dir->data);
+	if (!p) {
+		p = calloc(1, sizeof(struct project));
+		p->dir = strdup(dir->data);
+		p->next = projects;
+		projects = p;
+	}
+	pthread_mutex_unlock(&projects_lock);
+
+	str_free(dir);
+	str_free(fn);
+	return p;
+}
+
+struct flags *project_flags(struct project *p)
+{
+	struct stat st;
+	struct flags *f;
+	str_t *path;
+	int has_dotccode;
+
+	path = str_from_cstr(p->dir);
+	str_add_cstr(&path, "/.ccode");
+	has_dotccode = stat(path->data, &st) == 0;
+	str_free(path);
+
+	pthread_mutex_lock(&projects_lock);
+	if (p->flags && dotccode_unchanged(p, has_dotccode, &st)) {
+		// the output of commands in .ccode may change without .ccode
+		// itself being touched, serve what we have and look again
+		// in the background
+		if (!p->refreshing && time(0) - p->expanded_at >= flags_ttl)
+			queue_refresh(p);
+		f = flags_ref(p->flags);
+		pthread_mutex_unlock(&projects_lock);
+		return f;
+	}
+	pthread_mutex_unlock(&projects_lock);
+
+	// seen for the first time or .ccode has changed
+	f = expand_flags(p->dir);
+
+	pthread_mutex_lock(&projects_lock);
+	set_flags(p, f, has_dotccode, &st);
+	f = flags_ref(p->flags);
+	pthread_mutex_unlock(&projects_lock);
+	return f;
+}
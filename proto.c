@@ -1,5 +1,23 @@
 #include "shared.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Unlike TPL_FD dumping it doesn't spin on a non-blocking socket which
+// isn't ready for writing.
+static int tpl_dump_to_fd(tpl_node *tn, int fd)
+{
+	void *buf;
+	size_t sz;
+	int rc;
+
+	if (tpl_dump(tn, TPL_MEM, &buf, &sz) == -1)
+		return -1;
+	rc = write_all(fd, buf, sz);
+	free(buf);
+	return rc;
+}
 
 tpl_node *msg_node_pack(int msgtype)
 {
@@ -16,7 +34,13 @@ tpl_node *msg_ac_node(struct msg_ac *msg)
 			       &msg->buffer,
 			       &msg->filename,
 			       &msg->line,
-			       &msg->col);
+			       &msg->col,
+			       &msg->flags,
+			       &msg->limit,
+			       &msg->page,
+			       &msg->edit_start,
+			       &msg->edit_end,
+			       &msg->hash);
 	return tn;
 }
 
@@ -28,32 +52,119 @@ void free_msg_ac(struct msg_ac *msg)
 
 //-------------------------------------------------------------------------
 
-void msg_ac_response_send(struct msg_ac_response *msg, int sock)
+tpl_node *msg_open_node(struct msg_open *msg)
 {
-	struct ac_proposal prop;
-	tpl_node *tn;
+	tpl_node *tn = tpl_map(MSG_OPEN_FMT,
+			       &msg->buffer,
+			       &msg->filename);
+	return tn;
+}
 
-	tn = tpl_map(MSG_AC_RESPONSE_FMT,
-		     &msg->partial,
-		     &prop);
-	tpl_pack(tn, 0);
-	for (size_t i = 0; i < msg->proposals_n; ++i) {
-		prop = msg->proposals[i];
-		tpl_pack(tn, 1);
+void free_msg_open(struct msg_open *msg)
+{
+	free(msg->buffer.addr);
+	free(msg->filename);
+}
+
+//-------------------------------------------------------------------------
+
+// tpl image header flags, see tpl.c
+#define TPL_IMAGE_BIGENDIAN	1
+#define TPL_IMAGE_NULLSTRINGS	2
+
+// Lays out the image exactly like tpl_dump does for formats without
+// fixed-length arrays: magic, flags, size of the image, format, then the
+// data. Returns where the data goes, 'data_size' bytes of it. Strings are
+// prefixed with their length plus one, zero is reserved for null strings.
+static char *image_new(char **img, size_t *size, const char *fmt,
+		       size_t data_size)
+{
+	char flags = TPL_IMAGE_NULLSTRINGS;
+	size_t fmt_size = strlen(fmt) + 1;
+	uint32_t size32;
+	char *dst;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	flags |= TPL_IMAGE_BIGENDIAN;
+#endif
+
+	*size = 4 + sizeof(uint32_t) + fmt_size + data_size;
+	size32 = *size;
+
+	*img = dst = malloc(*size);
+	memcpy(dst, "tpl", 3);
+	dst[3] = flags;
+	dst += 4;
+	memcpy(dst, &size32, sizeof(uint32_t));
+	dst += sizeof(uint32_t);
+	memcpy(dst, fmt, fmt_size);
+	return dst + fmt_size;
+}
+
+static char *put_uint(char *dst, uint32_t v)
+{
+	memcpy(dst, &v, sizeof(uint32_t));
+	return dst + sizeof(uint32_t);
+}
+
+static char *put_len(char *dst, size_t len)
+{
+	return put_uint(dst, len + 1);
+}
+
+static char *put_int(char *dst, int v)
+{
+	int32_t v32 = v;
+	memcpy(dst, &v32, sizeof(int32_t));
+	return dst + sizeof(int32_t);
+}
+
+// Size of proposals [first, first + n) of 'p' in a tpl image, their strings
+// lose the nulls and get their lengths instead.
+static size_t tpl_proposals_size(struct bin_proposals *p, uint32_t first,
+				 uint32_t n)
+{
+	uint32_t begin = (n) ? p->words[first] : 0;
+	uint32_t end = (n) ? bin_proposal_end(p, first + n - 1) : 0;
+
+	return (end - begin) + n * (2 * sizeof(uint32_t) - 2 +
+				    2 * sizeof(int32_t));
+}
+
+static char *put_tpl_proposals(char *dst, struct bin_proposals *p,
+			       uint32_t first, uint32_t n)
+{
+	dst = put_uint(dst, n);
+	for (uint32_t i = first; i < first + n; i++) {
+		size_t word_len = p->abbrs[i] - p->words[i] - 1;
+		size_t abbr_len = bin_proposal_end(p, i) - p->abbrs[i] - 1;
+
+		dst = put_len(dst, word_len);
+		memcpy(dst, p->strings + p->words[i], word_len);
+		dst += word_len;
+		dst = put_len(dst, abbr_len);
+		memcpy(dst, p->strings + p->abbrs[i], abbr_len);
+		dst += abbr_len;
+		dst = put_int(dst, p->counts[i]);
+		dst = put_int(dst, p->ids[i]);
 	}
-	tpl_dump(tn, TPL_FD, sock);
-	tpl_free(tn);
+	return dst;
 }
 
-void msg_ac_response_recv(struct msg_ac_response *msg, int sock)
+int msg_ac_response_recv(struct msg_ac_response *msg, int sock)
 {
 	struct ac_proposal prop;
 	tpl_node *tn;
 
 	tn = tpl_map(MSG_AC_RESPONSE_FMT,
 		     &msg->partial,
+		     &msg->truncated,
+		     &msg->cursor,
 		     &prop);
-	tpl_load(tn, TPL_FD, sock);
+	if (tpl_load(tn, TPL_FD, sock) == -1) {
+		tpl_free(tn);
+		return -1;
+	}
 	tpl_unpack(tn, 0);
 	msg->proposals_n = tpl_Alen(tn, 1);
 	msg->proposals = malloc(sizeof(struct ac_proposal) *
@@ -62,12 +173,14 @@ void msg_ac_response_recv(struct msg_ac_response *msg, int sock)
 		tpl_unpack(tn, 1);
 		msg->proposals[i] = prop;
 	}
+	msg->borrowed = 0;
 	tpl_free(tn);
+	return 0;
 }
 
 void free_msg_ac_response(struct msg_ac_response *msg)
 {
-	for (size_t i = 0; i < msg->proposals_n; ++i) {
+	for (size_t i = 0; i < msg->proposals_n && !msg->borrowed; ++i) {
 		struct ac_proposal *p = &msg->proposals[i];
 		free(p->abbr);
 		free(p->word);
@@ -75,3 +188,563 @@ void free_msg_ac_response(struct msg_ac_response *msg)
 	if (msg->proposals)
 		free(msg->proposals);
 }
+
+void free_msg_ac_delta_response(struct msg_ac_delta_response *msg)
+{
+	free(msg->proposals);
+	free(msg->refs);
+}
+
+tpl_node *msg_ac_more_node(struct msg_ac_more *msg)
+{
+	tpl_node *tn = tpl_map(MSG_AC_MORE_FMT,
+			       &msg->cursor,
+			       &msg->page);
+	return tn;
+}
+
+//-------------------------------------------------------------------------
+
+// Size of the frame at the start of 'data', zero if there isn't enough of it
+// to tell yet, -1 if it's not a frame.
+static ssize_t frame_size_at(const char *data, size_t len)
+{
+	uint32_t size;
+	size_t min;
+
+	if (len < 4 + sizeof(uint32_t))
+		return 0;
+	if (memcmp(data, "tpl", 3) == 0)
+		min = 4 + sizeof(uint32_t);
+	else if (memcmp(data, BIN_MAGIC, 3) == 0 && data[3] == BIN_VERSION)
+		min = sizeof(struct bin_header);
+	else
+		return -1;
+	memcpy(&size, data + 4, sizeof(uint32_t));
+	return (size < min) ? -1 : (ssize_t)size;
+}
+
+ssize_t frame_read(struct frame_buffer *b, int fd)
+{
+	ssize_t size, n;
+	size_t want;
+
+	if (b->start) {
+		memmove(b->data, b->data + b->start, b->len - b->start);
+		b->len -= b->start;
+		b->start = 0;
+	}
+
+	size = frame_size_at(b->data, b->len);
+	want = (size > FRAME_BUFFER_MIN) ? (size_t)size : FRAME_BUFFER_MIN;
+	if (b->cap < want) {
+		b->data = realloc(b->data, want);
+		b->cap = want;
+	}
+
+	n = read(fd, b->data + b->len, b->cap - b->len);
+	if (n > 0)
+		b->len += n;
+	return n;
+}
+
+int frame_next(struct frame_buffer *b, const char **frame, size_t *size)
+{
+	ssize_t fsize = frame_size_at(b->data + b->start, b->len - b->start);
+
+	if (fsize == -1)
+		return -1;
+	if (!fsize || b->len - b->start < (size_t)fsize)
+		return 0;
+	*frame = b->data + b->start;
+	*size = fsize;
+	b->start += fsize;
+	return 1;
+}
+
+void free_frame_buffer(struct frame_buffer *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof(struct frame_buffer));
+}
+
+static void bin_header_init(struct bin_header *h, int msg_type, size_t size)
+{
+	memcpy(h->magic, BIN_MAGIC, 3);
+	h->version = BIN_VERSION;
+	h->size = size;
+	h->msg_type = msg_type;
+}
+
+int msg_ac_send_bin(struct msg_ac *msg, int sock)
+{
+	struct bin_header h;
+	struct bin_ac ac;
+	size_t filename_len = strlen(msg->filename);
+	struct iovec iov[4] = {
+		{ &h, sizeof(h) },
+		{ &ac, sizeof(ac) },
+		{ msg->filename, filename_len },
+		{ msg->buffer.addr, msg->buffer.sz },
+	};
+
+	bin_header_init(&h, MSG_AC, sizeof(h) + sizeof(ac) + filename_len +
+			msg->buffer.sz);
+	// no garbage in the padding at the end
+	memset(&ac, 0, sizeof(ac));
+	ac.hash = msg->hash;
+	ac.line = msg->line;
+	ac.col = msg->col;
+	ac.flags = msg->flags;
+	ac.limit = msg->limit;
+	ac.page = msg->page;
+	ac.edit_start = msg->edit_start;
+	ac.edit_end = msg->edit_end;
+	ac.filename_len = filename_len;
+	ac.buffer_len = msg->buffer.sz;
+	return writev_all(sock, iov, 4);
+}
+
+int msg_ac_from_bin(struct msg_ac *msg, const char *frame, size_t size)
+{
+	struct bin_header h;
+	struct bin_ac ac;
+	const char *src = frame + sizeof(h) + sizeof(ac);
+
+	if (size < sizeof(h) + sizeof(ac))
+		return -1;
+	memcpy(&h, frame, sizeof(h));
+	memcpy(&ac, frame + sizeof(h), sizeof(ac));
+	if (h.msg_type != MSG_AC ||
+	    (uint64_t)ac.filename_len + ac.buffer_len != size - (src - frame))
+		return -1;
+
+	msg->filename = malloc(ac.filename_len + 1);
+	memcpy(msg->filename, src, ac.filename_len);
+	msg->filename[ac.filename_len] = '\0';
+	src += ac.filename_len;
+
+	msg->buffer.addr = malloc(ac.buffer_len);
+	msg->buffer.sz = ac.buffer_len;
+	memcpy(msg->buffer.addr, src, ac.buffer_len);
+
+	msg->line = ac.line;
+	msg->col = ac.col;
+	msg->flags = ac.flags;
+	msg->limit = ac.limit;
+	msg->page = ac.page;
+	msg->edit_start = ac.edit_start;
+	msg->edit_end = ac.edit_end;
+	msg->hash = ac.hash;
+	return 0;
+}
+
+// 'arrays' is the number of uint32_t/int32_t arrays after the header,
+// which is 'header_size' bytes.
+static char *bin_frame_new(size_t *size, struct bin_proposals *p,
+			   int msg_type, size_t header_size, size_t arrays,
+			   uint32_t proposals_n, size_t strings_size)
+{
+	char *frame;
+
+	*size = sizeof(struct bin_header) + header_size +
+		arrays * proposals_n * sizeof(uint32_t) + strings_size;
+	frame = malloc(*size);
+	bin_header_init((struct bin_header*)frame, msg_type, *size);
+
+	p->n = proposals_n;
+	p->words = (uint32_t*)(frame + *size - strings_size) - 4 * proposals_n;
+	p->abbrs = p->words + proposals_n;
+	p->counts = (int32_t*)(p->abbrs + proposals_n);
+	p->ids = p->counts + proposals_n;
+	p->strings = frame + *size - strings_size;
+	p->strings_size = strings_size;
+	return frame;
+}
+
+char *bin_ac_response_new(size_t *size, struct bin_proposals *p, int partial,
+			  int truncated, int cursor, uint32_t proposals_n,
+			  size_t strings_size)
+{
+	struct bin_ac_response r = {
+		.partial = partial,
+		.truncated = truncated,
+		.cursor = cursor,
+		.proposals_n = proposals_n,
+		.strings_size = strings_size,
+	};
+	char *frame = bin_frame_new(size, p, MSG_AC_RESPONSE, sizeof(r), 4,
+				    proposals_n, strings_size);
+
+	memcpy(frame + sizeof(struct bin_header), &r, sizeof(r));
+	return frame;
+}
+
+char *bin_ac_delta_response_new(size_t *size, int32_t **refs,
+				struct bin_proposals *p, int partial,
+				int truncated, uint32_t refs_n,
+				uint32_t proposals_n, size_t strings_size)
+{
+	struct bin_ac_delta_response r = {
+		.partial = partial,
+		.truncated = truncated,
+		.refs_n = refs_n,
+		.proposals_n = proposals_n,
+		.strings_size = strings_size,
+	};
+	char *frame;
+
+	// refs come first, they are as many as proposals_n of another array
+	frame = bin_frame_new(size, p, MSG_AC_DELTA_RESPONSE,
+			      sizeof(r) + refs_n * sizeof(int32_t), 4,
+			      proposals_n, strings_size);
+	memcpy(frame + sizeof(struct bin_header), &r, sizeof(r));
+	*refs = (int32_t*)(frame + sizeof(struct bin_header) + sizeof(r));
+	return frame;
+}
+
+void bin_ac_response_get(char *frame, struct bin_ac_response *r,
+			 struct bin_proposals *p)
+{
+	char *arrays = frame + sizeof(struct bin_header) + sizeof(*r);
+
+	memcpy(r, frame + sizeof(struct bin_header), sizeof(*r));
+	p->n = r->proposals_n;
+	p->words = (uint32_t*)arrays;
+	p->abbrs = p->words + p->n;
+	p->counts = (int32_t*)(p->abbrs + p->n);
+	p->ids = p->counts + p->n;
+	p->strings = (char*)(p->ids + p->n);
+	p->strings_size = r->strings_size;
+}
+
+uint32_t bin_proposal_end(struct bin_proposals *p, uint32_t i)
+{
+	return p->abbrs[i] + strlen(p->strings + p->abbrs[i]) + 1;
+}
+
+int ac_response_send(char *frame, size_t size, int binary, int sock)
+{
+	struct bin_ac_response r;
+	struct bin_proposals p;
+
+	if (binary)
+		return write_all(sock, frame, size);
+
+	bin_ac_response_get(frame, &r, &p);
+	return ac_response_send_part(frame, 0, r.proposals_n, r.cursor, 0,
+				     sock);
+}
+
+int ac_response_send_part(char *frame, uint32_t first, uint32_t n,
+			  int cursor, int binary, int sock)
+{
+	struct bin_ac_response r;
+	struct bin_proposals p;
+	uint32_t begin, *offsets;
+	size_t size;
+	char *img, *dst;
+	int rc;
+
+	bin_ac_response_get(frame, &r, &p);
+	begin = (n) ? p.words[first] : 0;
+	if (!binary) {
+		dst = image_new(&img, &size, MSG_AC_RESPONSE_FMT,
+				3 * sizeof(int32_t) +
+				sizeof(uint32_t) +
+				tpl_proposals_size(&p, first, n));
+		dst = put_int(dst, r.partial);
+		dst = put_int(dst, r.truncated);
+		dst = put_int(dst, cursor);
+		put_tpl_proposals(dst, &p, first, n);
+		rc = write_all(sock, img, size);
+		free(img);
+		return rc;
+	}
+
+	// strings and the rest of the arrays go as they are, the offsets
+	// are made relative to the first string
+	struct bin_header h;
+	struct iovec iov[6] = {
+		{ &h, sizeof(h) },
+		{ &r, sizeof(r) },
+	};
+
+	offsets = malloc(2 * n * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		offsets[i] = p.words[first + i] - begin;
+		offsets[n + i] = p.abbrs[first + i] - begin;
+	}
+	r.cursor = cursor;
+	r.proposals_n = n;
+	r.strings_size = (n) ? bin_proposal_end(&p, first + n - 1) - begin : 0;
+	iov[2] = (struct iovec){ offsets, 2 * n * sizeof(uint32_t) };
+	iov[3] = (struct iovec){ p.counts + first, n * sizeof(int32_t) };
+	iov[4] = (struct iovec){ p.ids + first, n * sizeof(int32_t) };
+	iov[5] = (struct iovec){ p.strings + begin, r.strings_size };
+	bin_header_init(&h, MSG_AC_RESPONSE, sizeof(h) + sizeof(r) +
+			4 * n * sizeof(uint32_t) + r.strings_size);
+
+	rc = writev_all(sock, iov, 6);
+	free(offsets);
+	return rc;
+}
+
+int ac_delta_response_send(char *frame, size_t size, int binary, int sock)
+{
+	struct bin_ac_delta_response r;
+	struct bin_proposals p;
+	const char *refs = frame + sizeof(struct bin_header) + sizeof(r);
+	size_t img_size;
+	char *img, *dst;
+	int rc;
+
+	if (binary)
+		return write_all(sock, frame, size);
+
+	// the proposals are laid out like those of MSG_AC_RESPONSE after
+	// the refs
+	memcpy(&r, frame + sizeof(struct bin_header), sizeof(r));
+	p.n = r.proposals_n;
+	p.words = (uint32_t*)(refs + r.refs_n * sizeof(int32_t));
+	p.abbrs = p.words + p.n;
+	p.counts = (int32_t*)(p.abbrs + p.n);
+	p.ids = p.counts + p.n;
+	p.strings = (char*)(p.ids + p.n);
+	p.strings_size = r.strings_size;
+
+	dst = image_new(&img, &img_size, MSG_AC_DELTA_RESPONSE_FMT,
+			2 * sizeof(int32_t) +
+			sizeof(uint32_t) + r.refs_n * sizeof(int32_t) +
+			sizeof(uint32_t) + tpl_proposals_size(&p, 0, p.n));
+	dst = put_int(dst, r.partial);
+	dst = put_int(dst, r.truncated);
+	dst = put_uint(dst, r.refs_n);
+	memcpy(dst, refs, r.refs_n * sizeof(int32_t));
+	put_tpl_proposals(dst + r.refs_n * sizeof(int32_t), &p, 0, p.n);
+	rc = write_all(sock, img, img_size);
+	free(img);
+	return rc;
+}
+
+// waits for the next frame, -1 if the connection is gone
+static int recv_frame(struct frame_buffer *b, int sock, const char **frame,
+		      size_t *size)
+{
+	int rc;
+
+	while ((rc = frame_next(b, frame, size)) == 0) {
+		ssize_t n = frame_read(b, sock);
+		if (n == 0 || (n == -1 && errno != EINTR))
+			return -1;
+	}
+	return rc;
+}
+
+// 'src' is where the arrays are, the frame buffer isn't aligned, hence the
+// memcpy
+static struct ac_proposal *get_proposals(const char *src, uint32_t n,
+					 const char *strings,
+					 uint32_t strings_size)
+{
+	struct ac_proposal *proposals = malloc(sizeof(struct ac_proposal) * n);
+	size_t stride = n * sizeof(uint32_t);
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct ac_proposal *p = &proposals[i];
+		const char *v = src + i * sizeof(uint32_t);
+		uint32_t word, abbr;
+		int32_t count, id;
+
+		memcpy(&word, v, sizeof(uint32_t));
+		memcpy(&abbr, v + stride, sizeof(uint32_t));
+		memcpy(&count, v + 2 * stride, sizeof(int32_t));
+		memcpy(&id, v + 3 * stride, sizeof(int32_t));
+		p->count = count;
+		p->id = id;
+
+		if (word >= strings_size || abbr >= strings_size) {
+			free(proposals);
+			return 0;
+		}
+		p->word = (char*)strings + word;
+		p->abbr = (char*)strings + abbr;
+	}
+	return proposals;
+}
+
+static int check_strings(const char *frame, size_t size, const char *strings,
+			 uint32_t strings_size)
+{
+	if (size != (size_t)(strings - frame) + strings_size)
+		return -1;
+	if (strings_size && strings[strings_size - 1] != '\0')
+		return -1;
+	return 0;
+}
+
+int msg_ac_response_recv_bin(struct msg_ac_response *msg,
+			     struct frame_buffer *b, int sock)
+{
+	struct bin_header h;
+	struct bin_ac_response r;
+	const char *frame, *src, *strings;
+	size_t size;
+
+	if (recv_frame(b, sock, &frame, &size) == -1 ||
+	    size < sizeof(h) + sizeof(r))
+		return -1;
+
+	memcpy(&h, frame, sizeof(h));
+	memcpy(&r, frame + sizeof(h), sizeof(r));
+	src = frame + sizeof(h) + sizeof(r);
+	strings = src + (size_t)r.proposals_n * 4 * sizeof(uint32_t);
+	if (memcmp(h.magic, BIN_MAGIC, 3) != 0 ||
+	    h.msg_type != MSG_AC_RESPONSE ||
+	    check_strings(frame, size, strings, r.strings_size) == -1)
+		return -1;
+
+	msg->partial = r.partial;
+	msg->truncated = r.truncated;
+	msg->cursor = r.cursor;
+	msg->proposals_n = r.proposals_n;
+	msg->proposals = get_proposals(src, r.proposals_n, strings,
+				       r.strings_size);
+	msg->borrowed = 1;
+	return (msg->proposals || !r.proposals_n) ? 0 : -1;
+}
+
+int msg_ac_delta_response_recv_bin(struct msg_ac_delta_response *msg,
+				   struct frame_buffer *b, int sock)
+{
+	struct bin_header h;
+	struct bin_ac_delta_response r;
+	const char *frame, *src, *strings;
+	size_t size;
+
+	if (recv_frame(b, sock, &frame, &size) == -1 ||
+	    size < sizeof(h) + sizeof(r))
+		return -1;
+
+	memcpy(&h, frame, sizeof(h));
+	memcpy(&r, frame + sizeof(h), sizeof(r));
+	src = frame + sizeof(h) + sizeof(r);
+	strings = src + (size_t)r.refs_n * sizeof(int32_t) +
+		(size_t)r.proposals_n * 4 * sizeof(uint32_t);
+	if (memcmp(h.magic, BIN_MAGIC, 3) != 0 ||
+	    h.msg_type != MSG_AC_DELTA_RESPONSE ||
+	    check_strings(frame, size, strings, r.strings_size) == -1)
+		return -1;
+
+	msg->partial = r.partial;
+	msg->truncated = r.truncated;
+	msg->refs_n = r.refs_n;
+	msg->refs = malloc(sizeof(int) * r.refs_n);
+	for (uint32_t i = 0; i < r.refs_n; i++) {
+		int32_t ref;
+		memcpy(&ref, src + i * sizeof(int32_t), sizeof(int32_t));
+		msg->refs[i] = ref;
+	}
+	msg->proposals_n = r.proposals_n;
+	msg->proposals = get_proposals(src + r.refs_n * sizeof(int32_t),
+				       r.proposals_n, strings,
+				       r.strings_size);
+	if (!msg->proposals && r.proposals_n) {
+		free(msg->refs);
+		return -1;
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------
+
+tpl_node *msg_resolve_node(struct msg_resolve *msg)
+{
+	tpl_node *tn = tpl_map(MSG_RESOLVE_FMT,
+			       &msg->filename,
+			       &msg->id);
+	return tn;
+}
+
+void free_msg_resolve(struct msg_resolve *msg)
+{
+	free(msg->filename);
+}
+
+static tpl_node *msg_resolve_response_node(struct msg_resolve_response *msg)
+{
+	tpl_node *tn = tpl_map(MSG_RESOLVE_RESPONSE_FMT,
+			       &msg->availability,
+			       &msg->signature,
+			       &msg->comment,
+			       &msg->parent);
+	return tn;
+}
+
+void msg_resolve_response_send(struct msg_resolve_response *msg, int sock)
+{
+	tpl_node *tn = msg_resolve_response_node(msg);
+	tpl_pack(tn, 0);
+	tpl_dump_to_fd(tn, sock);
+	tpl_free(tn);
+}
+
+int msg_resolve_response_recv(struct msg_resolve_response *msg, int sock)
+{
+	tpl_node *tn = msg_resolve_response_node(msg);
+	if (tpl_load(tn, TPL_FD, sock) == -1) {
+		tpl_free(tn);
+		return -1;
+	}
+	tpl_unpack(tn, 0);
+	tpl_free(tn);
+	return 0;
+}
+
+void free_msg_resolve_response(struct msg_resolve_response *msg)
+{
+	free(msg->signature);
+	free(msg->comment);
+	free(msg->parent);
+}
+
+//-------------------------------------------------------------------------
+
+void msg_stats_response_send(char *text, int sock)
+{
+	tpl_node *tn = tpl_map(MSG_STATS_RESPONSE_FMT, &text);
+	tpl_pack(tn, 0);
+	tpl_dump_to_fd(tn, sock);
+	tpl_free(tn);
+}
+
+char *msg_stats_response_recv(int sock)
+{
+	char *text = 0;
+	tpl_node *tn = tpl_map(MSG_STATS_RESPONSE_FMT, &text);
+	tpl_load(tn, TPL_FD, sock);
+	tpl_unpack(tn, 0);
+	tpl_free(tn);
+	return text;
+}
+
+//-------------------------------------------------------------------------
+
+void msg_version_response_send(int sock)
+{
+	int version = PROTOCOL_VERSION;
+	tpl_node *tn = tpl_map(MSG_VERSION_RESPONSE_FMT, &version);
+	tpl_pack(tn, 0);
+	tpl_dump_to_fd(tn, sock);
+	tpl_free(tn);
+}
+
+int msg_version_response_recv(int sock)
+{
+	int version = -1;
+	tpl_node *tn = tpl_map(MSG_VERSION_RESPONSE_FMT, &version);
+	if (tpl_load(tn, TPL_FD, sock) == 0)
+		tpl_unpack(tn, 0);
+	tpl_free(tn);
+	return version;
+}
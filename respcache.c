@@ -0,0 +1,125 @@
+#include "server.h"
+#include <stdlib.h>
+
+// for reference
+static struct response *find_response(uint64_t key);
+static void unlink_response(struct response *r);
+
+//-------------------------------------------------------------------------
+
+// Protects the list and 'last_used', responses are immutable otherwise and
+// are sent outside of the lock.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct response *responses;
+static int responses_n;
+static int max_responses;
+static unsigned int use_counter;
+
+void response_cache_init(int size)
+{
+	max_responses = (size < 0) ? 0 : size;
+}
+
+void response_cache_free()
+{
+	while (responses) {
+		struct response *r = responses;
+		unlink_response(r);
+		response_unref(r);
+	}
+}
+
+// expects 'cache_lock' to be held
+static struct response *find_response(uint64_t key)
+{
+	for (struct response *r = responses; r; r = r->next) {
+		if (r->key == key)
+			return r;
+	}
+	return 0;
+}
+
+// expects 'cache_lock' to be held
+static void unlink_response(struct response *r)
+{
+	struct response **pr = &responses;
+	while (*pr != r)
+		pr = &(*pr)->next;
+	*pr = r->next;
+	r->next = 0;
+	responses_n--;
+}
+
+struct response *response_ref(struct response *r)
+{
+	__sync_fetch_and_add(&r->refs, 1);
+	return r;
+}
+
+void response_unref(struct response *r)
+{
+	if (__sync_sub_and_fetch(&r->refs, 1) == 0) {
+		free(r->data);
+		free(r);
+	}
+}
+
+struct response *response_cache_get(uint64_t key)
+{
+	struct response *r;
+
+	pthread_mutex_lock(&cache_lock);
+	r = find_response(key);
+	if (r) {
+		r->last_used = ++use_counter;
+		response_ref(r);
+		STATS_INC(response_hits);
+	} else {
+		STATS_INC(response_misses);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return r;
+}
+
+struct response *response_cache_put(uint64_t key, char *img, size_t size)
+{
+	struct response *r, *evicted = 0;
+
+	r = malloc(sizeof(struct response));
+	r->refs = 1;
+	r->key = key;
+	r->size = size;
+	r->next = 0;
+	r->data = img;
+
+	if (!max_responses)
+		return r;
+
+	pthread_mutex_lock(&cache_lock);
+	// another worker got there first, the two are the same
+	if (find_response(key)) {
+		pthread_mutex_unlock(&cache_lock);
+		return r;
+	}
+
+	if (responses_n >= max_responses) {
+		for (struct response *e = responses; e; e = e->next) {
+			if (!evicted || e->last_used < evicted->last_used)
+				evicted = e;
+		}
+		unlink_response(evicted);
+	}
+
+	// one reference is the cache's, the other is the caller's
+	r->refs = 2;
+	r->last_used = ++use_counter;
+	r->next = responses;
+	responses = r;
+	responses_n++;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (evicted)
+		response_unref(evicted);
+	return r;
+}
@@ -0,0 +1,1093 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// for reference
+static uint32_t add_text(struct result_table *t, const char *s, size_t len);
+static void decode_result(struct result_table *t, unsigned int i,
+			  CXCompletionString cs, str_t **type, str_t **display);
+static int results_cmp(const void *a, const void *b);
+static void alloc_columns(struct result_table *t, unsigned int n);
+static uint32_t result_id(struct result_table *t, unsigned int i);
+static void add_signature(str_t **s, CXCompletionString cs);
+static void copy_rows(struct result_table *t, struct result_table *src,
+		      unsigned int *idx, unsigned int n);
+static unsigned int split(unsigned int n, unsigned int *chunk_size);
+static unsigned int chunk_end(unsigned int n, unsigned int chunk_size,
+			      unsigned int chunk);
+static unsigned int prefix_filter(struct result_table *t, str_t *partial,
+				  unsigned int begin, unsigned int end,
+				  unsigned int *out, volatile int *cancelled);
+static unsigned int fuzzy_filter(struct result_table *t, str_t *partial,
+				 unsigned int begin, unsigned int end,
+				 unsigned int *out, int *scores,
+				 volatile int *cancelled);
+static unsigned int run_filter(struct result_table *t, str_t *partial,
+			       unsigned int *out, int *scores,
+			       volatile int *cancelled);
+static size_t abbr_len(struct result_table *t, unsigned int i, int width);
+static char *put_proposal(struct bin_proposals *p, unsigned int j, char *dst,
+			  struct result_table *t, unsigned int i, int width,
+			  int count);
+static void swap_idx(unsigned int *a, unsigned int *b);
+static uint32_t head_of(const char *s, size_t len);
+static void match_heads(uint64_t *bits, const uint32_t *head,
+			unsigned int n, uint32_t needle, uint32_t mask);
+static uint64_t char_bit(unsigned char c);
+static uint64_t charset_of(const char *s, size_t len);
+static int fuzzy_char_matches(char q, char c);
+static int position_bonus(const char *s, int i);
+static int fuzzy_score(const char *q, int q_len, const char *s, int s_len);
+
+//-------------------------------------------------------------------------
+
+#define WIDTH_SIGNIFICANCE_THRESHOLD 100
+#define ELLIPSIS "…"
+
+// smaller sets of results aren't worth spreading over the thread pool
+#define PARALLEL_THRESHOLD 8192
+#define CHUNKS_PER_THREAD 4
+
+// candidates matched between checks for cancellation, multiple of 64
+#define FILTER_BLOCK 16384
+
+// fuzzy scoring
+#define MAX_FUZZY_LEN 128
+#define NO_MATCH (INT_MIN / 2)
+#define BONUS_FIRST 8
+#define BONUS_BOUNDARY 6
+#define BONUS_CONSECUTIVE 4
+#define BONUS_CASE 1
+#define PENALTY_GAP 1
+
+// qsort has no context argument, each worker sorts one table at a time
+static __thread struct result_table *sorted_table;
+static __thread int *sorted_scores;
+
+// Splits 'n' items into chunks for parallel_for, returns how many. There
+// is only one chunk if 'n' is small.
+static unsigned int split(unsigned int n, unsigned int *chunk_size)
+{
+	unsigned int chunks_n = 1;
+
+	if (n >= PARALLEL_THRESHOLD)
+		chunks_n = pool_size() * CHUNKS_PER_THREAD;
+	*chunk_size = (n + chunks_n - 1) / chunks_n;
+	if (!*chunk_size)
+		return 0;
+	return (n + *chunk_size - 1) / *chunk_size;
+}
+
+static unsigned int chunk_end(unsigned int n, unsigned int chunk_size,
+			      unsigned int chunk)
+{
+	unsigned int end = (chunk + 1) * chunk_size;
+	return (end > n) ? n : end;
+}
+
+static uint32_t head_of(const char *s, size_t len)
+{
+	uint32_t head = 0;
+	memcpy(&head, s, (len < 4) ? len : 4);
+	return head;
+}
+
+// appends 's' with a terminating zero to the arena, returns its offset
+static uint32_t add_text(struct result_table *t, const char *s, size_t len)
+{
+	uint32_t off = t->text_len;
+
+	if (t->text_len + len + 1 > t->text_cap) {
+		while (t->text_len + len + 1 > t->text_cap)
+			t->text_cap *= 2;
+		t->text = realloc(t->text, t->text_cap);
+	}
+	memcpy(t->text + t->text_len, s, len);
+	t->text[t->text_len + len] = '\0';
+	t->text_len += len + 1;
+	return off;
+}
+
+static void decode_result(struct result_table *t, unsigned int i,
+			  CXCompletionString cs, str_t **type, str_t **display)
+{
+	unsigned int chunks_n = clang_getNumCompletionChunks(cs);
+	int has_typed = 0;
+
+	str_clear(*type);
+	str_clear(*display);
+
+	for (unsigned int j = 0; j < chunks_n; ++j) {
+		enum CXCompletionChunkKind kind;
+		CXString s;
+		const char *text;
+
+		kind = clang_getCompletionChunkKind(cs, j);
+		s = clang_getCompletionChunkText(cs, j);
+		text = clang_getCString(s);
+		if (!text)
+			text = "";
+
+		switch (kind) {
+		case CXCompletionChunk_ResultType:
+			str_add_cstr(type, text);
+			break;
+		case CXCompletionChunk_TypedText:
+			if (!has_typed) {
+				t->typed_len[i] = strlen(text);
+				t->typed[i] = add_text(t, text,
+						       t->typed_len[i]);
+				t->head[i] = head_of(text, t->typed_len[i]);
+				t->charset[i] = charset_of(text,
+							   t->typed_len[i]);
+				has_typed = 1;
+			}
+			// fall through
+		default:
+			str_add_cstr(display, text);
+			break;
+		}
+		clang_disposeString(s);
+	}
+
+	// results without typed text never match a partial identifier
+	if (!has_typed) {
+		t->typed[i] = add_text(t, "", 0);
+		t->typed_len[i] = 0;
+		t->head[i] = 0;
+		t->charset[i] = 0;
+	}
+	t->type[i] = add_text(t, (*type)->data, (*type)->len);
+	t->type_len[i] = (*type)->len;
+	t->display[i] = add_text(t, (*display)->data, (*display)->len);
+	t->display_len[i] = (*display)->len;
+	t->priority[i] = clang_getCompletionPriority(cs);
+	t->string[i] = cs;
+	t->id[i] = result_id(t, i);
+}
+
+// Ids identify results by what the user sees, the same declaration gets the
+// same id in the next completion.
+static uint32_t result_id(struct result_table *t, unsigned int i)
+{
+	uint64_t h;
+
+	h = hash_bytes(HASH_INIT, &t->kind[i], sizeof(enum CXCursorKind));
+	h = hash_bytes(h, t->text + t->type[i], t->type_len[i] + 1);
+	h = hash_bytes(h, t->text + t->display[i], t->display_len[i]);
+	return h ^ (h >> 32);
+}
+
+// grows or allocates the columns to 'n' rows
+static void alloc_columns(struct result_table *t, unsigned int n)
+{
+	t->priority = realloc(t->priority, sizeof(unsigned int) * n);
+	t->kind = realloc(t->kind, sizeof(enum CXCursorKind) * n);
+	t->typed = realloc(t->typed, sizeof(uint32_t) * n);
+	t->typed_len = realloc(t->typed_len, sizeof(uint32_t) * n);
+	t->head = realloc(t->head, sizeof(uint32_t) * n);
+	t->charset = realloc(t->charset, sizeof(uint64_t) * n);
+	t->type = realloc(t->type, sizeof(uint32_t) * n);
+	t->type_len = realloc(t->type_len, sizeof(uint32_t) * n);
+	t->display = realloc(t->display, sizeof(uint32_t) * n);
+	t->display_len = realloc(t->display_len, sizeof(uint32_t) * n);
+	t->id = realloc(t->id, sizeof(uint32_t) * n);
+	t->string = realloc(t->string, sizeof(CXCompletionString) * n);
+}
+
+// Decoded on the calling thread only, libclang doesn't promise anything
+// about using CXCodeCompleteResults from several threads at once. The passes
+// over the decoded table are what runs in parallel.
+struct result_table *result_table_new(CXCodeCompleteResults *results)
+{
+	struct result_table *t = calloc(1, sizeof(struct result_table));
+	unsigned int n = results->NumResults;
+	str_t *type = str_new(0);
+	str_t *display = str_new(0);
+
+	t->n = n;
+	alloc_columns(t, n);
+	t->text_cap = 4096;
+	t->text = malloc(t->text_cap);
+
+	for (unsigned int i = 0; i < n; ++i) {
+		CXCompletionResult *r = &results->Results[i];
+		t->kind[i] = r->CursorKind;
+		decode_result(t, i, r->CompletionString, &type, &display);
+	}
+
+	str_free(type);
+	str_free(display);
+	return t;
+}
+
+// appends rows 'idx' of 'src' to 't', all of them if 'idx' is zero
+static void copy_rows(struct result_table *t, struct result_table *src,
+		      unsigned int *idx, unsigned int n)
+{
+	unsigned int first = t->n;
+
+	t->n += n;
+	alloc_columns(t, t->n);
+	for (unsigned int i = 0; i < n; ++i) {
+		unsigned int r = (idx) ? idx[i] : i;
+		unsigned int j = first + i;
+
+		t->priority[j] = src->priority[r];
+		t->kind[j] = src->kind[r];
+		t->typed[j] = add_text(t, src->text + src->typed[r],
+				       src->typed_len[r]);
+		t->typed_len[j] = src->typed_len[r];
+		t->head[j] = src->head[r];
+		t->charset[j] = src->charset[r];
+		t->type[j] = add_text(t, src->text + src->type[r],
+				      src->type_len[r]);
+		t->type_len[j] = src->type_len[r];
+		t->display[j] = add_text(t, src->text + src->display[r],
+					 src->display_len[r]);
+		t->display_len[j] = src->display_len[r];
+		t->id[j] = src->id[r];
+		t->string[j] = src->string[r];
+	}
+}
+
+struct result_table *result_table_subset(struct result_table *t,
+					 unsigned int *idx, unsigned int n)
+{
+	struct result_table *sub = calloc(1, sizeof(struct result_table));
+
+	sub->text_cap = 4096;
+	sub->text = malloc(sub->text_cap);
+	copy_rows(sub, t, idx, n);
+	return sub;
+}
+
+void result_table_append(struct result_table *t, struct result_table *src)
+{
+	copy_rows(t, src, 0, src->n);
+}
+
+void result_table_free(struct result_table *t)
+{
+	free(t->priority);
+	free(t->kind);
+	free(t->typed);
+	free(t->typed_len);
+	free(t->head);
+	free(t->charset);
+	free(t->type);
+	free(t->type_len);
+	free(t->display);
+	free(t->display_len);
+	free(t->id);
+	free(t->string);
+	free(t->text);
+	free(t);
+}
+
+// Sets bit 'i' of 'bits' if '(head[i] & mask) == needle', 'n' is a multiple
+// of 64 or the last block. Four candidates per instruction with SSE2, eight
+// with AVX2, identifiers are rarely longer than that, so this rules out
+// almost everything in one go.
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void match_heads_avx2(uint64_t *bits, const uint32_t *head,
+			     unsigned int n, uint32_t needle, uint32_t mask)
+{
+	__m256i vneedle = _mm256_set1_epi32(needle);
+	__m256i vmask = _mm256_set1_epi32(mask);
+	unsigned int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i h = _mm256_loadu_si256((const __m256i*)(head + i));
+		__m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(h, vmask),
+						vneedle);
+		uint64_t m = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+		bits[i / 64] |= m << (i % 64);
+	}
+	for (; i < n; i++) {
+		if ((head[i] & mask) == needle)
+			bits[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+}
+
+__attribute__((target("sse2")))
+static void match_heads_sse2(uint64_t *bits, const uint32_t *head,
+			     unsigned int n, uint32_t needle, uint32_t mask)
+{
+	__m128i vneedle = _mm_set1_epi32(needle);
+	__m128i vmask = _mm_set1_epi32(mask);
+	unsigned int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i h = _mm_loadu_si128((const __m128i*)(head + i));
+		__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(h, vmask), vneedle);
+		uint64_t m = _mm_movemask_ps(_mm_castsi128_ps(eq));
+		bits[i / 64] |= m << (i % 64);
+	}
+	for (; i < n; i++) {
+		if ((head[i] & mask) == needle)
+			bits[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+}
+#endif
+
+static void match_heads(uint64_t *bits, const uint32_t *head,
+			unsigned int n, uint32_t needle, uint32_t mask)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static int have_avx2 = -1;
+	if (have_avx2 == -1)
+		have_avx2 = __builtin_cpu_supports("avx2");
+
+	if (have_avx2)
+		match_heads_avx2(bits, head, n, needle, mask);
+	else if (__builtin_cpu_supports("sse2"))
+		match_heads_sse2(bits, head, n, needle, mask);
+	else
+#endif
+	for (unsigned int i = 0; i < n; i++) {
+		if ((head[i] & mask) == needle)
+			bits[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+}
+
+static unsigned int prefix_filter(struct result_table *t, str_t *partial,
+				  unsigned int begin, unsigned int end,
+				  unsigned int *out, volatile int *cancelled)
+{
+	unsigned int n = 0;
+	uint64_t bits[FILTER_BLOCK / 64];
+	uint32_t needle, mask = 0;
+	size_t head_len;
+
+	// Heads are zero padded and identifiers have no zero bytes, a typed
+	// text shorter than the head of 'partial' never matches. Longer
+	// partials are verified for survivors only.
+	head_len = (partial->len < 4) ? partial->len : 4;
+	needle = head_of(partial->data, head_len);
+	memset(&mask, 0xFF, head_len);
+
+	for (unsigned int base = begin; base < end && !*cancelled;
+	     base += FILTER_BLOCK)
+	{
+		unsigned int block_n = end - base;
+		if (block_n > FILTER_BLOCK)
+			block_n = FILTER_BLOCK;
+
+		memset(bits, 0, sizeof(uint64_t) * ((block_n + 63) / 64));
+		match_heads(bits, t->head + base, block_n, needle, mask);
+
+		for (unsigned int w = 0; w < (block_n + 63) / 64; w++) {
+			uint64_t word = bits[w];
+			while (word) {
+				unsigned int i = base + w * 64 +
+						 __builtin_ctzll(word);
+				word &= word - 1;
+
+				if (partial->len > 4) {
+					if (t->typed_len[i] < partial->len)
+						continue;
+					if (memcmp(t->text + t->typed[i] + 4,
+						   partial->data + 4,
+						   partial->len - 4) != 0)
+						continue;
+				}
+				out[n++] = i;
+			}
+		}
+	}
+	return n;
+}
+
+// Letters regardless of case, digits and '_' get a bit each, the rest share
+// a few. A result can only match if it has all the bits of the query.
+static uint64_t char_bit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return (uint64_t)1 << (c - 'a');
+	if (c >= 'A' && c <= 'Z')
+		return (uint64_t)1 << (c - 'A');
+	if (c >= '0' && c <= '9')
+		return (uint64_t)1 << (26 + c - '0');
+	if (c == '_')
+		return (uint64_t)1 << 36;
+	return (uint64_t)1 << (37 + c % 27);
+}
+
+static uint64_t charset_of(const char *s, size_t len)
+{
+	uint64_t set = 0;
+	for (size_t i = 0; i < len; i++)
+		set |= char_bit(s[i]);
+	return set;
+}
+
+// smart case, lower case matches both, upper case matches only itself
+static int fuzzy_char_matches(char q, char c)
+{
+	if (q == c)
+		return 1;
+	return islower((unsigned char)q) && tolower((unsigned char)c) == q;
+}
+
+// start of the identifier or of a word in snake_case or camelCase
+static int position_bonus(const char *s, int i)
+{
+	unsigned char prev, cur = s[i];
+
+	if (i == 0)
+		return BONUS_FIRST;
+	prev = s[i-1];
+	if (!isalnum(prev))
+		return BONUS_BOUNDARY;
+	if (islower(prev) && isupper(cur))
+		return BONUS_BOUNDARY;
+	if (isalpha(prev) && isdigit(cur))
+		return BONUS_BOUNDARY;
+	return 0;
+}
+
+// Best score of matching 'q' as a subsequence of 's', NO_MATCH if it's not
+// one. Matches at word starts and runs of consecutive matches are rewarded,
+// skipped characters in between are penalized.
+static int fuzzy_score(const char *q, int q_len, const char *s, int s_len)
+{
+	// score of the best match of q[0..i] with q[i] at s[j]
+	int rows[2][MAX_FUZZY_LEN];
+	int *prev = rows[0], *cur = rows[1];
+	int best;
+
+	if (q_len > s_len || s_len > MAX_FUZZY_LEN)
+		return NO_MATCH;
+
+	for (int i = 0; i < q_len; i++) {
+		// best of prev[k] for k < j, minus the gap between k and j
+		int before = NO_MATCH;
+
+		for (int j = 0; j < s_len; j++) {
+			int score = NO_MATCH;
+
+			if (fuzzy_char_matches(q[i], s[j])) {
+				int bonus = position_bonus(s, j);
+				if (q[i] == s[j])
+					bonus += BONUS_CASE;
+
+				if (i == 0) {
+					score = bonus - j * PENALTY_GAP;
+				} else {
+					if (before != NO_MATCH)
+						score = before + bonus;
+					if (j > 0 && prev[j-1] != NO_MATCH &&
+					    prev[j-1] + bonus + BONUS_CONSECUTIVE > score)
+						score = prev[j-1] + bonus +
+							BONUS_CONSECUTIVE;
+				}
+			}
+			if (i > 0) {
+				if (before != NO_MATCH)
+					before -= PENALTY_GAP;
+				if (prev[j] > before)
+					before = prev[j];
+			}
+			cur[j] = score;
+		}
+
+		int *tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+
+	best = NO_MATCH;
+	for (int j = 0; j < s_len; j++) {
+		if (prev[j] > best)
+			best = prev[j];
+	}
+	return best;
+}
+
+static unsigned int fuzzy_filter(struct result_table *t, str_t *partial,
+				 unsigned int begin, unsigned int end,
+				 unsigned int *out, int *scores,
+				 volatile int *cancelled)
+{
+	unsigned int n = 0;
+	uint64_t set = charset_of(partial->data, partial->len);
+
+	for (unsigned int i = begin; i < end && !*cancelled; ++i) {
+		int score;
+
+		// cheap enough to run on everything, unlike the scorer
+		if ((t->charset[i] & set) != set)
+			continue;
+
+		score = fuzzy_score(partial->data, partial->len,
+				    t->text + t->typed[i], t->typed_len[i]);
+		if (score == NO_MATCH)
+			continue;
+		scores[i] = score;
+		out[n++] = i;
+	}
+	return n;
+}
+
+// Each chunk writes its survivors to the start of its own part of 'out',
+// they are moved together afterwards.
+struct filter_ctx {
+	struct result_table *t;
+	str_t *partial;
+	unsigned int *out;
+	int *scores;
+	volatile int *cancelled;
+	unsigned int chunk_size;
+	unsigned int *counts;
+};
+
+static void filter_chunk(void *ctx, unsigned int chunk)
+{
+	struct filter_ctx *f = ctx;
+	unsigned int begin = chunk * f->chunk_size;
+	unsigned int end = chunk_end(f->t->n, f->chunk_size, chunk);
+
+	if (f->scores)
+		f->counts[chunk] = fuzzy_filter(f->t, f->partial, begin, end,
+						f->out + begin, f->scores,
+						f->cancelled);
+	else
+		f->counts[chunk] = prefix_filter(f->t, f->partial, begin, end,
+						 f->out + begin, f->cancelled);
+}
+
+static unsigned int run_filter(struct result_table *t, str_t *partial,
+			       unsigned int *out, int *scores,
+			       volatile int *cancelled)
+{
+	struct filter_ctx f = {
+		.t = t, .partial = partial, .out = out, .scores = scores,
+		.cancelled = cancelled,
+	};
+	unsigned int chunks_n, n = 0;
+
+	if (!partial) {
+		for (unsigned int i = 0; i < t->n; ++i)
+			out[i] = i;
+		return t->n;
+	}
+
+	chunks_n = split(t->n, &f.chunk_size);
+	f.counts = malloc(sizeof(unsigned int) * chunks_n);
+	parallel_for(chunks_n, filter_chunk, &f);
+
+	for (unsigned int i = 0; i < chunks_n; i++) {
+		memmove(out + n, out + i * f.chunk_size,
+			sizeof(unsigned int) * f.counts[i]);
+		n += f.counts[i];
+	}
+	free(f.counts);
+	return n;
+}
+
+unsigned int filter_results(struct result_table *t, str_t *partial,
+			    unsigned int *out, volatile int *cancelled)
+{
+	return run_filter(t, partial, out, 0, cancelled);
+}
+
+unsigned int filter_results_fuzzy(struct result_table *t, str_t *partial,
+				  unsigned int *out, int *scores,
+				  volatile int *cancelled)
+{
+	return run_filter(t, partial, out, scores, cancelled);
+}
+
+int type_column_width(struct result_table *t, str_t *partial,
+		      unsigned int *idx, unsigned int n)
+{
+	int width = 0;
+
+	// too many results to bother, the column is going to be wide anyway
+	if (!partial && n > WIDTH_SIGNIFICANCE_THRESHOLD)
+		return MAX_TYPE_CHARS;
+
+	for (unsigned int i = 0; i < n && width != MAX_TYPE_CHARS; ++i) {
+		int l = t->type_len[idx[i]];
+		if (l > width)
+			width = (l > MAX_TYPE_CHARS) ? MAX_TYPE_CHARS : l;
+	}
+	return width;
+}
+
+static int results_cmp(const void *a, const void *b)
+{
+	struct result_table *t = sorted_table;
+	unsigned int i1 = *(const unsigned int*)a;
+	unsigned int i2 = *(const unsigned int*)b;
+	int cmp;
+
+	if (sorted_scores && sorted_scores[i1] != sorted_scores[i2])
+		return (sorted_scores[i1] > sorted_scores[i2]) ? -1 : 1;
+	if (t->priority[i1] != t->priority[i2])
+		return (int)t->priority[i1] - (int)t->priority[i2];
+	cmp = strcmp(t->text + t->typed[i1], t->text + t->typed[i2]);
+	if (cmp)
+		return cmp;
+
+	// the same name in a different form, e.g. 'typeof' for expressions
+	// and for types, the order shouldn't depend on how we've sorted
+	return (i1 < i2) ? -1 : (i1 > i2);
+}
+
+// Chunks are sorted in parallel, then merged pairwise, each round of
+// merges in parallel too.
+struct sort_ctx {
+	struct result_table *t;
+	int *scores;
+	unsigned int n;
+	unsigned int run;
+	unsigned int *src;
+	unsigned int *dst;
+};
+
+static void sort_chunk(void *ctx, unsigned int chunk)
+{
+	struct sort_ctx *s = ctx;
+	unsigned int begin = chunk * s->run;
+	unsigned int end = chunk_end(s->n, s->run, chunk);
+
+	sorted_table = s->t;
+	sorted_scores = s->scores;
+	qsort(s->src + begin, end - begin, sizeof(unsigned int), results_cmp);
+	sorted_table = 0;
+	sorted_scores = 0;
+}
+
+static void merge_runs(void *ctx, unsigned int pair)
+{
+	struct sort_ctx *s = ctx;
+	unsigned int lo = pair * 2 * s->run;
+	unsigned int mid = chunk_end(s->n, s->run, pair * 2);
+	unsigned int hi = chunk_end(s->n, s->run, pair * 2 + 1);
+	unsigned int i = lo, j = mid, k = lo;
+
+	sorted_table = s->t;
+	sorted_scores = s->scores;
+	while (i < mid && j < hi) {
+		if (results_cmp(&s->src[j], &s->src[i]) < 0)
+			s->dst[k++] = s->src[j++];
+		else
+			s->dst[k++] = s->src[i++];
+	}
+	while (i < mid)
+		s->dst[k++] = s->src[i++];
+	while (j < hi)
+		s->dst[k++] = s->src[j++];
+	sorted_table = 0;
+	sorted_scores = 0;
+}
+
+void sort_results(struct result_table *t, unsigned int *idx, unsigned int n,
+		  int *scores)
+{
+	struct sort_ctx s = { t, scores, n, 0, idx, 0 };
+	unsigned int chunks_n = split(n, &s.run);
+	unsigned int *tmp;
+
+	parallel_for(chunks_n, sort_chunk, &s);
+	if (chunks_n < 2)
+		return;
+
+	tmp = malloc(sizeof(unsigned int) * n);
+	s.dst = tmp;
+	for (; s.run < n; s.run *= 2) {
+		unsigned int *swap;
+
+		parallel_for((n + 2 * s.run - 1) / (2 * s.run), merge_runs, &s);
+		swap = s.src;
+		s.src = s.dst;
+		s.dst = swap;
+	}
+	if (s.src != idx)
+		memcpy(idx, s.src, sizeof(unsigned int) * n);
+	free(tmp);
+}
+
+int find_result(struct result_table *t, uint32_t id)
+{
+	for (unsigned int i = 0; i < t->n; ++i) {
+		if (t->id[i] == id)
+			return i;
+	}
+	return -1;
+}
+
+// all chunks, optional ones in brackets
+static void add_signature(str_t **s, CXCompletionString cs)
+{
+	unsigned int chunks_n = clang_getNumCompletionChunks(cs);
+
+	for (unsigned int j = 0; j < chunks_n; ++j) {
+		enum CXCompletionChunkKind kind;
+		CXString text;
+
+		kind = clang_getCompletionChunkKind(cs, j);
+		if (kind == CXCompletionChunk_Optional) {
+			str_add_cstr(s, "[");
+			add_signature(s, clang_getCompletionChunkCompletionString(cs, j));
+			str_add_cstr(s, "]");
+			continue;
+		}
+
+		text = clang_getCompletionChunkText(cs, j);
+		if (clang_getCString(text))
+			str_add_cstr(s, clang_getCString(text));
+		if (kind == CXCompletionChunk_ResultType)
+			str_add_cstr(s, " ");
+		clang_disposeString(text);
+	}
+}
+
+static char *dup_cxstring(CXString s)
+{
+	const char *c = clang_getCString(s);
+	char *ret = strdup((c) ? c : "");
+	clang_disposeString(s);
+	return ret;
+}
+
+void resolve_result(struct msg_resolve_response *out, struct result_table *t,
+		    unsigned int i)
+{
+	CXCompletionString cs = t->string[i];
+	str_t *signature = str_new(0);
+
+	add_signature(&signature, cs);
+	out->signature = strdup(signature->data);
+	str_free(signature);
+
+	out->availability = clang_getCompletionAvailability(cs);
+	out->comment = dup_cxstring(clang_getCompletionBriefComment(cs));
+	out->parent = dup_cxstring(clang_getCompletionParent(cs, 0));
+}
+
+unsigned int keep_exact_matches(struct result_table *t, size_t len,
+				unsigned int *idx, unsigned int n)
+{
+	unsigned int kept = 0;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		if (t->typed_len[idx[i]] == len)
+			idx[kept++] = idx[i];
+	}
+	return kept;
+}
+
+// Open addressing over the typed text, slots hold positions in 'idx' of the
+// best result of each group so far.
+unsigned int collapse_results(struct result_table *t, unsigned int *idx,
+			      unsigned int n, int *scores,
+			      unsigned int *counts)
+{
+	unsigned int slots_n = 16, kept = 0;
+	unsigned int *slots;
+
+	while (slots_n < n * 2)
+		slots_n *= 2;
+	slots = malloc(sizeof(unsigned int) * slots_n);
+	memset(slots, 0xFF, sizeof(unsigned int) * slots_n);
+
+	sorted_table = t;
+	sorted_scores = scores;
+	for (unsigned int i = 0; i < n; ++i) {
+		unsigned int r = idx[i];
+		const char *typed = t->text + t->typed[r];
+		uint64_t h = hash_bytes(HASH_INIT, typed, t->typed_len[r]);
+		unsigned int s = h & (slots_n - 1);
+
+		while (slots[s] != (unsigned int)-1) {
+			unsigned int best = idx[slots[s]];
+			if (t->typed_len[best] == t->typed_len[r] &&
+			    memcmp(t->text + t->typed[best], typed,
+				   t->typed_len[r]) == 0)
+				break;
+			s = (s + 1) & (slots_n - 1);
+		}
+
+		if (slots[s] == (unsigned int)-1) {
+			slots[s] = kept;
+			idx[kept++] = r;
+			counts[r] = 1;
+			continue;
+		}
+
+		unsigned int best = idx[slots[s]];
+		if (results_cmp(&r, &best) < 0) {
+			counts[r] = counts[best];
+			idx[slots[s]] = r;
+			best = r;
+		}
+		counts[best]++;
+	}
+	sorted_table = 0;
+	sorted_scores = 0;
+
+	free(slots);
+	return kept;
+}
+
+enum result_group result_group(enum CXCursorKind kind)
+{
+	switch (kind) {
+	case CXCursor_MacroDefinition:
+		return GROUP_MACROS;
+	case CXCursor_FunctionDecl:
+	case CXCursor_CXXMethod:
+	case CXCursor_Constructor:
+	case CXCursor_Destructor:
+	case CXCursor_ConversionFunction:
+	case CXCursor_FunctionTemplate:
+	case CXCursor_ObjCInstanceMethodDecl:
+	case CXCursor_ObjCClassMethodDecl:
+		return GROUP_FUNCTIONS;
+	case CXCursor_StructDecl:
+	case CXCursor_UnionDecl:
+	case CXCursor_ClassDecl:
+	case CXCursor_EnumDecl:
+	case CXCursor_TypedefDecl:
+	case CXCursor_TypeAliasDecl:
+	case CXCursor_ClassTemplate:
+	case CXCursor_ObjCInterfaceDecl:
+	case CXCursor_ObjCProtocolDecl:
+		return GROUP_TYPES;
+	default:
+		return GROUP_OTHERS;
+	}
+}
+
+unsigned int cap_results(struct result_table *t, unsigned int *idx,
+			 unsigned int n, const unsigned int *caps)
+{
+	unsigned int taken[GROUPS_N] = {0};
+	unsigned int kept = 0;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		enum result_group g = result_group(t->kind[idx[i]]);
+		if (caps[g] && taken[g] == caps[g])
+			continue;
+		taken[g]++;
+		idx[kept++] = idx[i];
+	}
+	return kept;
+}
+
+static void swap_idx(unsigned int *a, unsigned int *b)
+{
+	unsigned int tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+void partition_results(struct result_table *t, unsigned int *idx,
+		       unsigned int n, unsigned int k, int *scores)
+{
+	unsigned int lo = 0, hi = n;
+
+	if (k >= n)
+		return;
+
+	sorted_table = t;
+	sorted_scores = scores;
+
+	// quickselect, until the k-th element is in place
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		unsigned int store = lo;
+
+		// median of three as the pivot, moved to the end
+		if (results_cmp(&idx[mid], &idx[lo]) < 0)
+			swap_idx(&idx[mid], &idx[lo]);
+		if (results_cmp(&idx[hi-1], &idx[lo]) < 0)
+			swap_idx(&idx[hi-1], &idx[lo]);
+		if (results_cmp(&idx[mid], &idx[hi-1]) < 0)
+			swap_idx(&idx[mid], &idx[hi-1]);
+
+		for (unsigned int i = lo; i < hi - 1; i++) {
+			if (results_cmp(&idx[i], &idx[hi-1]) < 0)
+				swap_idx(&idx[i], &idx[store++]);
+		}
+		swap_idx(&idx[store], &idx[hi-1]);
+
+		if (store == k)
+			break;
+		if (store < k)
+			lo = store + 1;
+		else
+			hi = store;
+	}
+
+	sorted_table = 0;
+	sorted_scores = 0;
+}
+
+void select_results(struct result_table *t, unsigned int *idx, unsigned int n,
+		    unsigned int k, int *scores)
+{
+	if (k > n)
+		k = n;
+	partition_results(t, idx, n, k, scores);
+	sort_results(t, idx, k, scores);
+}
+
+// result type right-aligned to 'width', followed by the rest, truncated
+// types are wider than any column
+static size_t abbr_len(struct result_table *t, unsigned int i, int width)
+{
+	size_t len = t->type_len[i];
+
+	if (len > MAX_TYPE_CHARS)
+		len = MAX_TYPE_CHARS - 1 + sizeof(ELLIPSIS) - 1;
+	else if (len < (size_t)width)
+		len = width;
+	return len + 1 + t->display_len[i];
+}
+
+// Proposal 'j' of the frame is result 'i', its strings go to 'dst'. Returns
+// where the next ones go.
+static char *put_proposal(struct bin_proposals *p, unsigned int j, char *dst,
+			  struct result_table *t, unsigned int i, int width,
+			  int count)
+{
+	const char *type = t->text + t->type[i];
+	int type_len = t->type_len[i];
+
+	p->words[j] = dst - p->strings;
+	memcpy(dst, t->text + t->typed[i], t->typed_len[i]);
+	dst += t->typed_len[i];
+	*dst++ = '\0';
+
+	p->abbrs[j] = dst - p->strings;
+	if (type_len > MAX_TYPE_CHARS) {
+		memcpy(dst, type, MAX_TYPE_CHARS - 1);
+		dst += MAX_TYPE_CHARS - 1;
+		memcpy(dst, ELLIPSIS, sizeof(ELLIPSIS) - 1);
+		dst += sizeof(ELLIPSIS) - 1;
+	} else {
+		if (type_len < width) {
+			memset(dst, ' ', width - type_len);
+			dst += width - type_len;
+		}
+		memcpy(dst, type, type_len);
+		dst += type_len;
+	}
+	*dst++ = ' ';
+	memcpy(dst, t->text + t->display[i], t->display_len[i]);
+	dst += t->display_len[i];
+	*dst++ = '\0';
+
+	p->counts[j] = count;
+	p->ids[j] = t->id[i];
+	return dst;
+}
+
+// Sizes of all strings are known up front, each chunk of a batch is sized
+// first and then written at its offset into the string table.
+struct format_ctx {
+	struct ac_frame *f;
+	unsigned int begin;
+	unsigned int end;
+	volatile int *cancelled;
+	unsigned int chunk_size;
+	size_t *offsets;
+};
+
+static void size_chunk(void *ctx, unsigned int chunk)
+{
+	struct format_ctx *fc = ctx;
+	struct ac_frame *f = fc->f;
+	unsigned int begin = fc->begin + chunk * fc->chunk_size;
+	unsigned int end = fc->begin + chunk_end(fc->end - fc->begin,
+						 fc->chunk_size, chunk);
+	size_t size = 0;
+
+	for (unsigned int i = begin; i < end; ++i) {
+		unsigned int r = f->idx[i];
+		size += f->t->typed_len[r] + abbr_len(f->t, r, f->width) + 2;
+	}
+	fc->offsets[chunk] = size;
+}
+
+static void format_chunk(void *ctx, unsigned int chunk)
+{
+	struct format_ctx *fc = ctx;
+	struct ac_frame *f = fc->f;
+	unsigned int begin = fc->begin + chunk * fc->chunk_size;
+	unsigned int end = fc->begin + chunk_end(fc->end - fc->begin,
+						 fc->chunk_size, chunk);
+	char *dst = f->p.strings + fc->offsets[chunk];
+
+	for (unsigned int i = begin; i < end && !*fc->cancelled; ++i) {
+		unsigned int r = f->idx[i];
+		dst = put_proposal(&f->p, i, dst, f->t, r, f->width,
+				   (f->counts) ? f->counts[r] : 1);
+	}
+}
+
+// Sizes of proposals [begin, end) by chunks, 'offsets' gets where each chunk
+// starts, relative to the first one. Returns the size of all of them.
+static size_t size_chunks(struct format_ctx *fc, unsigned int chunks_n)
+{
+	size_t total = 0;
+
+	parallel_for(chunks_n, size_chunk, fc);
+	for (unsigned int i = 0; i < chunks_n; i++) {
+		size_t chunk_size = fc->offsets[i];
+		fc->offsets[i] = total;
+		total += chunk_size;
+	}
+	return total;
+}
+
+void ac_frame_init(struct ac_frame *f, int partial, int truncated,
+		   struct result_table *t, unsigned int *idx, unsigned int n,
+		   int width, unsigned int *counts)
+{
+	struct format_ctx fc = { .f = f, .begin = 0, .end = n };
+	unsigned int chunks_n = split(n, &fc.chunk_size);
+	size_t total;
+
+	f->t = t;
+	f->idx = idx;
+	f->width = width;
+	f->counts = counts;
+	f->formatted = 0;
+	f->strings_used = 0;
+
+	fc.offsets = malloc(sizeof(size_t) * chunks_n);
+	total = size_chunks(&fc, chunks_n);
+	free(fc.offsets);
+	f->data = bin_ac_response_new(&f->size, &f->p, partial, truncated, 0,
+				      n, total);
+}
+
+void ac_frame_format(struct ac_frame *f, unsigned int end,
+		     volatile int *cancelled)
+{
+	struct format_ctx fc = {
+		.f = f, .begin = f->formatted, .end = end,
+		.cancelled = cancelled,
+	};
+	unsigned int chunks_n = split(end - f->formatted, &fc.chunk_size);
+	size_t base = f->strings_used;
+
+	fc.offsets = malloc(sizeof(size_t) * chunks_n);
+	f->strings_used += size_chunks(&fc, chunks_n);
+	for (unsigned int i = 0; i < chunks_n; i++)
+		fc.offsets[i] += base;
+	parallel_for(chunks_n, format_chunk, &fc);
+	free(fc.offsets);
+	f->formatted = end;
+}
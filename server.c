@@ -1,5 +1,4 @@
-#include "shared.h"
-#include <sys/select.h>
+#include "server.h"
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdlib.h>
@@ -7,93 +6,51 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <signal.h>
-#include <wordexp.h>
-#include <clang-c/Index.h>
-
-struct make_ac_ctx {
-	str_t *word;
-	str_t *abbr;
-	str_t *type;
-	str_t *text;
-};
-
-static void init_make_ac_ctx(struct make_ac_ctx *ctx);
-static void free_make_ac_ctx(struct make_ac_ctx *ctx);
 
 // for reference
 static int create_server_socket(const str_t *file);
-static void server_loop(int sock);
-static void process_ac(int sock);
-static void print_completion_result(CXCompletionResult *r);
-static int make_ac_proposal(struct make_ac_ctx *ctx,
-			    struct ac_proposal *p,
-			    CXCompletionResult *r,
-			    str_t *fmt);
+static void process_job(struct job *job);
+static void send_empty_ac_response(struct job *job, int partial);
+static int stream_page(struct msg_ac *msg);
+static void send_ac_response(struct job *job, struct response *r,
+			     uint32_t sent);
+static void process_ac(struct job *job);
+static void process_more(struct job *job);
+static void process_open(struct job *job);
+static void process_resolve(struct job *job);
+static void process_stats(int sock);
+static struct flags *file_flags(const char *filename);
+static uint64_t request_key(struct msg_ac *msg, struct flags *flags);
 static str_t *extract_partial(struct msg_ac *msg);
+static uint64_t results_key(struct msg_ac *msg, str_t *partial);
+static uint64_t macros_key(struct msg_ac *msg);
+static int wants_macros(CXCodeCompleteResults *results);
+static unsigned int select_kind(struct result_table *t, unsigned int *out,
+				int macros);
+static struct result_table *complete_at(struct tu_entry *entry,
+					struct msg_ac *msg,
+					str_t *partial,
+					struct CXUnsavedFile *unsaved);
 static int isident(int c);
-static void try_load_dotccode(wordexp_t *wexp);
+static void init_group_caps();
 static void handle_sigint(int);
-static int wordexps_the_same(wordexp_t *a, wordexp_t *b);
-static int needs_reparsing(wordexp_t *w, const char *filename);
-static void sort_cc_results(CXCompletionResult *results, size_t results_n);
-static int code_completion_results_cmp(CXCompletionResult *r1,
-				       CXCompletionResult *r2);
-static CXString get_result_typed_text(CXCompletionResult *r);
-static size_t count_type_chars(CXCompletionResult *r);
-static size_t filter_out_cc_results(CXCompletionResult *results,
-				    size_t results_n, str_t *partial,
-				    str_t **fmt);
-static str_t *all_results_fmt(CXCompletionResult *results,
-				   size_t results_n);
 
 //-------------------------------------------------------------------------
 
 static CXIndex clang_index;
-static CXTranslationUnit clang_tu;
-static char *last_filename;
-static wordexp_t last_wordexp;
 static str_t *sock_path;
+static unsigned int group_caps[GROUPS_N];
+static int group_caps_set;
+
+struct server_stats stats;
 
 #define SERVER_SOCKET_BACKLOG 10
 #define MAX_AC_RESULTS 999999
-#define MAX_TYPE_CHARS 20
-#define WIDTH_SIGNIFICANCE_THRESHOLD 100
-#define AUTO_SHUTDOWN_TIME 15
-
-static void init_make_ac_ctx(struct make_ac_ctx *ctx)
-{
-	ctx->word = str_new(0);
-	ctx->abbr = str_new(0);
-	ctx->type = str_new(0);
-	ctx->text = str_new(0);
-}
-
-static void free_make_ac_ctx(struct make_ac_ctx *ctx)
-{
-	str_free(ctx->word);
-	str_free(ctx->abbr);
-	str_free(ctx->type);
-	str_free(ctx->text);
-}
-
-static int needs_reparsing(wordexp_t *w, const char *filename)
-{
-	if (!last_filename)
-		return 1;
-
-	if (strcmp(filename, last_filename) != 0)
-		return 1;
-
-	if (!wordexps_the_same(w, &last_wordexp))
-		return 1;
-
-	return 0;
-}
 
 static int create_server_socket(const str_t *file)
 {
 	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sock == -1)
+	if (sock == -1 || set_cloexec(sock) == -1)
 		return -1;
 
 	struct sockaddr_un addr;
@@ -113,55 +70,34 @@ static int create_server_socket(const str_t *file)
 	return sock;
 }
 
-static void server_loop(int sock)
+static void process_job(struct job *job)
 {
-	struct timeval oneminute = { 60, 0 };
-	fd_set sockset;
-	int minutes_idle = 0;
-
-	// accepting and dispatching messages
-	for (;;) {
-		int msg_type;
-		tpl_node *tn;
-		int incoming;
-		int maxfd, result;
-
-		FD_ZERO(&sockset);
-		FD_SET(sock, &sockset);
-		maxfd = sock;
-		result = select(maxfd+1, &sockset, 0, 0, &oneminute);
-		if (!result) {
-			minutes_idle++;
-			if (minutes_idle >= AUTO_SHUTDOWN_TIME)
-				return;
-			continue;
-		}
-
-		minutes_idle = 0;
-		incoming = accept(sock, 0, 0);
-		if (incoming == -1) {
-			fprintf(stderr, "Error! Failed to accept an incoming connection.\n");
-			exit(1);
-		}
-
-		tn = tpl_map("i", &msg_type);
-		tpl_load(tn, TPL_FD, incoming);
-		tpl_unpack(tn, 0);
-		tpl_free(tn);
-
-		switch (msg_type) {
-		case MSG_CLOSE:
-			close(incoming);
-			return;
-		case MSG_AC:
-			process_ac(incoming);
-			break;
-		default:
-			;
-		}
-
-		close(incoming);
+	switch (job->msg_type) {
+	case MSG_AC:
+		process_ac(job);
+		break;
+	case MSG_STATS:
+		process_stats(job->sock);
+		break;
+	case MSG_VERSION:
+		msg_version_response_send(job->sock);
+		break;
+	case MSG_OPEN:
+		process_open(job);
+		break;
+	case MSG_AC_MORE:
+		process_more(job);
+		break;
+	case MSG_RESOLVE:
+		process_resolve(job);
+		break;
+	case JOB_REFRESH_FLAGS:
+		project_refresh(job->msg.project);
+		break;
+	default:
+		;
 	}
+	conn_job_done(job);
 }
 
 static str_t *extract_partial(struct msg_ac *msg)
@@ -194,6 +130,162 @@ static str_t *extract_partial(struct msg_ac *msg)
 	return str_from_cstr_len(c, cursor - c);
 }
 
+// Hash of the buffer without the partial identifier. Completions at the
+// start of the identifier don't depend on the identifier itself, as long as
+// everything else is the same, the results can be filtered again.
+static uint64_t results_key(struct msg_ac *msg, str_t *partial)
+{
+	char *buf = msg->buffer.addr;
+	char *c = buf;
+	char *end = buf + msg->buffer.sz;
+	size_t partial_len = (partial) ? partial->len : 0;
+	uint64_t h;
+
+	for (int line = 1; line < msg->line && c != end; line++) {
+		while (c != end && *c++ != '\n')
+			;
+	}
+	c += msg->col - 1;
+	if (c > end)
+		c = end;
+
+	h = hash_bytes(HASH_INIT, buf, c - buf);
+	c += partial_len;
+	if (c > end)
+		c = end;
+	return hash_bytes(h, c, end - c);
+}
+
+// Hash of the preprocessor directives above the line of 'msg', macros
+// defined in the file itself may come and go. Macros collected at one line
+// are in scope at another one only if the same directives precede both.
+static uint64_t macros_key(struct msg_ac *msg)
+{
+	char *c = msg->buffer.addr;
+	char *end = c + msg->buffer.sz;
+	uint64_t h = HASH_INIT;
+
+	for (int line = 1; c != end && line < msg->line; line++) {
+		char *start = c;
+
+		while (c != end && (*c == ' ' || *c == '\t'))
+			c++;
+		if (c != end && *c == '#') {
+			// up to the first newline not escaped by '\'
+			while (c != end && *c != '\n') {
+				if (*c == '\\' && c + 1 != end) {
+					if (*++c == '\n')
+						line++;
+				}
+				c++;
+			}
+			h = hash_bytes(h, start, c - start);
+		}
+		while (c != end && *c++ != '\n')
+			;
+	}
+	return h;
+}
+
+// Macros can't follow '.' or '->', or appear in an #include, but anything
+// that takes a type or a value may be one. Clang doesn't always know,
+// macros are kept then.
+static int wants_macros(CXCodeCompleteResults *results)
+{
+	unsigned long long contexts = clang_codeCompleteGetContexts(results);
+
+	if (contexts == CXCompletionContext_Unexposed)
+		return 1;
+	return (contexts & (CXCompletionContext_AnyType |
+			    CXCompletionContext_AnyValue |
+			    CXCompletionContext_MacroName)) != 0;
+}
+
+// writes indices of macros or of everything else to 'out', returns how many
+static unsigned int select_kind(struct result_table *t, unsigned int *out,
+				int macros)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < t->n; ++i) {
+		if ((t->kind[i] == CXCursor_MacroDefinition) == macros)
+			out[n++] = i;
+	}
+	return n;
+}
+
+// Code completion results at the position 'msg' points to, the entry owns
+// them. Expects 'msg->col' to be at the start of 'partial'.
+//
+// Macros are asked for only if the entry has no valid macro table, they
+// are split off into it then. Otherwise the table is appended to the
+// results where macros make sense.
+static struct result_table *complete_at(struct tu_entry *entry,
+					struct msg_ac *msg,
+					str_t *partial,
+					struct CXUnsavedFile *unsaved)
+{
+	uint64_t key = results_key(msg, partial);
+	uint64_t mkey = macros_key(msg);
+	int have_macros = entry->macros && entry->macros_key == mkey;
+	unsigned int *idx, n;
+
+	if (entry->results &&
+	    entry->results_line == msg->line &&
+	    entry->results_col == msg->col &&
+	    entry->results_key == key)
+	{
+		STATS_INC(results_reused);
+		return entry->table;
+	}
+
+	if (entry->results) {
+		if (entry->results != entry->macros_results)
+			clang_disposeCodeCompleteResults(entry->results);
+		result_table_free(entry->table);
+		entry->results = 0;
+		entry->table = 0;
+	}
+	entry->results = clang_codeCompleteAt(entry->tu, msg->filename,
+					      msg->line, msg->col,
+					      unsaved, 1,
+					      CXCodeComplete_IncludeBriefComments |
+					      ((have_macros) ? 0 :
+					       CXCodeComplete_IncludeMacros));
+	if (!entry->results)
+		return 0;
+
+	entry->table = result_table_new(entry->results);
+	idx = malloc(sizeof(unsigned int) * entry->table->n);
+	if (!have_macros) {
+		if (entry->macros)
+			result_table_free(entry->macros);
+		if (entry->macros_results)
+			clang_disposeCodeCompleteResults(entry->macros_results);
+		n = select_kind(entry->table, idx, 1);
+		entry->macros = result_table_subset(entry->table, idx, n);
+		entry->macros_results = entry->results;
+		entry->macros_key = mkey;
+
+		if (!wants_macros(entry->results)) {
+			struct result_table *t = entry->table;
+			n = select_kind(t, idx, 0);
+			entry->table = result_table_subset(t, idx, n);
+			result_table_free(t);
+		}
+	} else if (wants_macros(entry->results)) {
+		// clang lists macros on its own after #ifdef and such
+		if (select_kind(entry->table, idx, 1) == 0)
+			result_table_append(entry->table, entry->macros);
+	}
+	free(idx);
+
+	entry->results_line = msg->line;
+	entry->results_col = msg->col;
+	entry->results_key = key;
+	return entry->table;
+}
+
 static int isident(int c)
 {
 	if (isalnum(c) || c == '_')
@@ -201,83 +293,174 @@ static int isident(int c)
 	return 0;
 }
 
-static void try_load_dotccode(wordexp_t *wexp)
+static struct flags *file_flags(const char *filename)
 {
-	void *buf;
-	size_t size;
+	return project_flags(project_get(filename));
+}
+
+// Hash of everything the response depends on, as far as we can tell. Headers
+// changing on disk aren't noticed, just like by the reused preamble.
+static uint64_t request_key(struct msg_ac *msg, struct flags *flags)
+{
+	// these change only how the response is sent
+	int ac_flags = msg->flags &
+		~(AC_STREAM | AC_DELTA | AC_KEEP | AC_EDIT);
+	uint64_t h;
+
+	h = hash_bytes(HASH_INIT, msg->filename, strlen(msg->filename) + 1);
+	for (int i = 0; i < flags->argc; i++)
+		h = hash_bytes(h, flags->argv[i], strlen(flags->argv[i]) + 1);
+	h = hash_bytes(h, &msg->line, sizeof(msg->line));
+	h = hash_bytes(h, &msg->col, sizeof(msg->col));
+	h = hash_bytes(h, &ac_flags, sizeof(ac_flags));
+	h = hash_bytes(h, &msg->limit, sizeof(msg->limit));
+	h = hash_bytes(h, &msg->buffer.sz, sizeof(msg->buffer.sz));
+	return hash_bytes(h, msg->buffer.addr, msg->buffer.sz);
+}
 
-	wexp->we_wordc = 0;
-	wexp->we_wordv = 0;
+static void process_open(struct job *job)
+{
+	struct msg_open *msg = &job->msg.open;
+	int preamble_hit;
+
+	struct CXUnsavedFile unsaved = {
+		msg->filename,
+		msg->buffer.addr,
+		msg->buffer.sz
+	};
+
+	struct tu_entry *entry = tu_cache_get(msg->filename,
+					      file_flags(msg->filename),
+					      &unsaved, &preamble_hit);
+	if (entry)
+		tu_cache_release(entry);
+}
+
+// Looks for the proposal in the last completion, the user is most likely
+// going through its list. Never parses anything.
+static void process_resolve(struct job *job)
+{
+	struct msg_resolve *msg = &job->msg.resolve;
+	struct msg_resolve_response msg_r = { -1, 0, 0, 0 };
+	struct tu_entry *entry;
+
+	entry = tu_cache_find(msg->filename, file_flags(msg->filename));
+	if (entry) {
+		struct result_table *t = entry->table;
+		int i = (t) ? find_result(t, msg->id) : -1;
+
+		if (i == -1 && entry->macros) {
+			t = entry->macros;
+			i = find_result(t, msg->id);
+		}
+		if (i != -1)
+			resolve_result(&msg_r, t, i);
+		tu_cache_release(entry);
+	}
+	msg_resolve_response_send(&msg_r, job->sock);
+	free_msg_resolve_response(&msg_r);
+}
+
+static void send_empty_ac_response(struct job *job, int partial)
+{
+	struct bin_proposals p;
+	char *frame;
+	size_t size;
 
-	if (read_file(&buf, &size, ".ccode") == -1) {
+	if (job->msg.ac.flags & AC_DELTA) {
+		send_empty_delta(partial, conn_delta_base(job->conn),
+				 job->binary, job->sock);
 		return;
 	}
 
-	// TODO: fstr trim? cstr trim?
-	str_t *contents = str_from_cstr_len(buf, (unsigned int)size);
-	str_trim(contents);
+	frame = bin_ac_response_new(&size, &p, partial, 0, 0, 0, 0);
+	ac_response_send(frame, size, job->binary, job->sock);
+	free(frame);
+}
 
-	wordexp(contents->data, wexp, 0);
-	str_free(contents);
-	free(buf);
+// How many proposals go in each response of a stream, zero if not
+// streaming. Delta responses are never streamed.
+static int stream_page(struct msg_ac *msg)
+{
+	if (!(msg->flags & AC_STREAM) || (msg->flags & AC_DELTA))
+		return 0;
+	return (msg->page > 0) ? msg->page : STREAM_DEFAULT_PAGE;
 }
 
-static void change_dir(const char *filename)
+// sends 'r', only what comes after the first 'sent' proposals if streaming
+static void send_ac_response(struct job *job, struct response *r,
+			     uint32_t sent)
 {
-	str_t *dir, *fn;
-	fn = str_from_cstr(filename);
-	dir = str_split_path(fn, 0);
-	chdir(dir->data);
-	str_free(dir);
-	str_free(fn);
+	struct msg_ac *msg = &job->msg.ac;
+
+	if (msg->flags & AC_DELTA)
+		send_delta(r, conn_delta_base(job->conn), job->binary,
+			   job->sock);
+	else if (stream_page(msg))
+		send_stream(r, sent, stream_page(msg), job->binary,
+			    job->sock);
+	else
+		send_first_page(r, msg->page, job->binary, job->sock);
 }
 
-static void process_ac(int sock)
+static void process_ac(struct job *job)
 {
-	tpl_node *tn;
-	struct msg_ac msg;
-	wordexp_t flags;
+	struct msg_ac *msg = &job->msg.ac;
+	char *img = 0;
+	size_t img_size;
+	unsigned int sent = 0;
+
+	// edits apply in order, even those of superseded requests
+	if (apply_edit(conn_kept_buffers(job->conn), msg) == -1) {
+		STATS_INC(resends);
+		send_empty_ac_response(job, AC_RESEND);
+		return;
+	}
+	if (msg->flags & AC_EDIT)
+		STATS_INC(edits);
 
-	tn = msg_ac_node(&msg);
-	tpl_load(tn, TPL_FD, sock);
-	tpl_unpack(tn, 0);
-	tpl_free(tn);
+	// superseded while waiting in the queue, don't even bother
+	if (job->cancelled) {
+		send_empty_ac_response(job, AC_CANCELLED);
+		return;
+	}
 
 	struct CXUnsavedFile unsaved = {
-		msg.filename,
-		msg.buffer.addr,
-		msg.buffer.sz
+		msg->filename,
+		msg->buffer.addr,
+		msg->buffer.sz
 	};
 
-	change_dir(msg.filename);
-	try_load_dotccode(&flags);
+	// nothing has changed since the last time, neither will the response
+	struct flags *flags = file_flags(msg->filename);
+	uint64_t key = request_key(msg, flags);
+	struct response *cached = response_cache_get(key);
+	if (cached) {
+		STATS_INC(requests);
+		send_ac_response(job, cached, 0);
+		response_unref(cached);
+		flags_unref(flags);
+		return;
+	}
 
-	str_t *partial = extract_partial(&msg);
+	str_t *partial = extract_partial(msg);
+	int partial_len = (partial) ? partial->len : 0;
 
-	if (partial)
-		msg.col -= partial->len;
-
-	if (needs_reparsing(&flags, msg.filename)) {
-		if (clang_tu)
-			clang_disposeTranslationUnit(clang_tu);
-
-		clang_tu = clang_parseTranslationUnit(clang_index, msg.filename,
-						      (char const * const *)flags.we_wordv,
-						      flags.we_wordc,
-						      &unsaved, 1,
-						      clang_defaultEditingTranslationUnitOptions());
-		if (last_filename)
-			free(last_filename);
-		if (last_wordexp.we_wordv)
-			wordfree(&last_wordexp);
-		last_filename = strdup(msg.filename);
-		last_wordexp = flags;
-	}
+	msg->col -= partial_len;
+
+	int preamble_hit;
+	struct tu_entry *entry = tu_cache_get(msg->filename, flags, &unsaved,
+					      &preamble_hit);
+	STATS_INC(requests);
+	if (preamble_hit)
+		STATS_INC(preamble_hits);
+	else
+		STATS_INC(preamble_misses);
 
 	// diag
 	/*
-	for (int i = 0, n = clang_getNumDiagnostics(clang_tu); i != n; ++i) {
-		CXDiagnostic diag = clang_getDiagnostic(clang_tu, i);
+	for (int i = 0, n = clang_getNumDiagnostics(entry->tu); i != n; ++i) {
+		CXDiagnostic diag = clang_getDiagnostic(entry->tu, i);
 		CXString string = clang_formatDiagnostic(diag, clang_defaultDiagnosticDisplayOptions());
 		fprintf(stderr, "%s\n", clang_getCString(string));
 		clang_disposeString(string);
@@ -285,11 +468,11 @@ static void process_ac(int sock)
 	}
 	*/
 
-	CXCodeCompleteResults *results;
-	results = clang_codeCompleteAt(clang_tu, msg.filename, msg.line, msg.col,
-				       &unsaved, 1,
-				       CXCodeComplete_IncludeMacros);
-	free_msg_ac(&msg);
+	// libclang can't be interrupted, but there is no point in going
+	// through the results if a newer request has arrived meanwhile
+	struct result_table *table = 0;
+	if (entry && !job->cancelled)
+		table = complete_at(entry, msg, partial, &unsaved);
 
 	// diag
 	/*
@@ -302,201 +485,162 @@ static void process_ac(int sock)
 	}
 	*/
 
-	struct msg_ac_response msg_r = { (partial) ? partial->len : 0, 0, 0 };
-
-	if (results) {
-		struct make_ac_ctx ctx;
-		str_t *fmt;
-
-		init_make_ac_ctx(&ctx);
-		msg_r.proposals_n = filter_out_cc_results(results->Results,
-							  results->NumResults,
-							  partial, &fmt);
-		sort_cc_results(results->Results, msg_r.proposals_n);
-		if (msg_r.proposals_n > MAX_AC_RESULTS)
-			msg_r.proposals_n = MAX_AC_RESULTS;
-		msg_r.proposals = malloc(sizeof(struct ac_proposal) *
-					 msg_r.proposals_n);
-
-		int cur = 0;
-		for (int i = 0; i < msg_r.proposals_n; ++i) {
-			int added;
-			added = make_ac_proposal(&ctx,
-						 &msg_r.proposals[cur],
-						 &results->Results[i],
-						 fmt);
-			if (added)
-				cur++;
+	if (table) {
+		unsigned int *idx = malloc(sizeof(unsigned int) * table->n);
+		unsigned int *counts = 0;
+		int *scores = 0;
+		unsigned int n, matched;
+		int width;
+
+		if ((msg->flags & AC_EXACT) && partial) {
+			n = filter_results(table, partial, idx,
+					   &job->cancelled);
+			n = keep_exact_matches(table, partial->len, idx, n);
+		} else if ((msg->flags & AC_FUZZY) && partial) {
+			scores = malloc(sizeof(int) * table->n);
+			n = filter_results_fuzzy(table, partial, idx, scores,
+						 &job->cancelled);
+		} else {
+			n = filter_results(table, partial, idx,
+					   &job->cancelled);
 		}
-		msg_r.proposals_n = cur;
-		free_make_ac_ctx(&ctx);
-		str_free(fmt);
+
+		if ((msg->flags & AC_COLLAPSE) && !job->cancelled) {
+			counts = malloc(sizeof(unsigned int) * table->n);
+			n = collapse_results(table, idx, n, scores, counts);
+		}
+		matched = n;
+
+		// only the best results are sorted if there is a limit
+		unsigned int limit = MAX_AC_RESULTS;
+		if (msg->limit > 0 && msg->limit < MAX_AC_RESULTS)
+			limit = msg->limit;
+		if (!job->cancelled && n > limit) {
+			partition_results(table, idx, n, limit, scores);
+			if (!(msg->flags & AC_UNSORTED_TAIL))
+				n = limit;
+		}
+		if (n > MAX_AC_RESULTS)
+			n = MAX_AC_RESULTS;
+
+		// The first page of a stream is picked and sorted on its own,
+		// the rest is sorted after it's gone out. Caps depend on the
+		// order of everything before them, there is no early page
+		// with those.
+		unsigned int to_sort = (n < limit) ? n : limit;
+		unsigned int page = stream_page(msg);
+		unsigned int in_order = n;
+		if (job->cancelled) {
+			// nothing is going to be sent anyway
+		} else if (group_caps_set) {
+			sort_results(table, idx, to_sort, scores);
+			n = cap_results(table, idx, n, group_caps);
+			in_order = n;
+		} else if (page && to_sort > page) {
+			select_results(table, idx, to_sort, page, scores);
+			in_order = page;
+		} else {
+			sort_results(table, idx, to_sort, scores);
+		}
+		width = type_column_width(table, partial, idx, n);
+
+		// Each batch of a stream goes out as soon as it's formatted,
+		// the last one goes with the response below. The stream ends
+		// with an empty AC_CANCELLED response if the rest doesn't make
+		// it.
+		struct ac_frame frame;
+		ac_frame_init(&frame, partial_len, n < matched, table, idx, n,
+			      width, counts);
+		while (page && n - frame.formatted > page && !job->cancelled) {
+			ac_frame_format(&frame, frame.formatted + page,
+					&job->cancelled);
+			if (job->cancelled)
+				break;
+			ac_response_send_part(frame.data, frame.formatted - page,
+					      page, AC_STREAMED, job->binary,
+					      job->sock);
+
+			// the loop runs at least once if there is an early page
+			if (in_order < n) {
+				sort_results(table, idx + in_order,
+					     to_sort - in_order, scores);
+				in_order = n;
+			}
+		}
+		sent = frame.formatted;
+		ac_frame_format(&frame, n, &job->cancelled);
+		img = frame.data;
+		img_size = frame.size;
+		free(counts);
+		free(scores);
+		free(idx);
 	}
 
 	if (partial)
 
 		str_free(partial);
-	clang_disposeCodeCompleteResults(results);
-
-	msg_ac_response_send(&msg_r, sock);
-	free_msg_ac_response(&msg_r);
-}
+	if (entry)
+		tu_cache_release(entry);
 
-static int code_completion_results_cmp(CXCompletionResult *r1,
-				       CXCompletionResult *r2)
-{
-	int prio1 = clang_getCompletionPriority(r1->CompletionString);
-	int prio2 = clang_getCompletionPriority(r2->CompletionString);
-	if (prio1 != prio2)
-		return prio1 - prio2;
-
-	CXString r1t = get_result_typed_text(r1);
-	CXString r2t = get_result_typed_text(r2);
-	int cmp = strcmp(clang_getCString(r1t),
-			 clang_getCString(r2t));
-	clang_disposeString(r1t);
-	clang_disposeString(r2t);
-	return cmp;
-}
-
-static CXString get_result_typed_text(CXCompletionResult *r)
-{
-	unsigned int chunks_n = clang_getNumCompletionChunks(r->CompletionString);
-	for (unsigned int i = 0; i < chunks_n; ++i) {
-		enum CXCompletionChunkKind kind;
-		kind = clang_getCompletionChunkKind(r->CompletionString, i);
-		if (kind == CXCompletionChunk_TypedText)
-			return clang_getCompletionChunkText(r->CompletionString, i);
+	if (job->cancelled) {
+		free(img);
+		send_empty_ac_response(job, AC_CANCELLED);
+		return;
 	}
-	CXString empty = {0,0};
-	return empty;
-}
-
-static size_t count_type_chars(CXCompletionResult *r)
-{
-	unsigned int chars = 0;
-	unsigned int chunks_n = clang_getNumCompletionChunks(r->CompletionString);
-	for (unsigned int i = 0; i < chunks_n; ++i) {
-		enum CXCompletionChunkKind kind;
-		kind = clang_getCompletionChunkKind(r->CompletionString, i);
-		if (kind == CXCompletionChunk_ResultType) {
-			CXString s = clang_getCompletionChunkText(r->CompletionString, i);
-			chars += strlen(clang_getCString(s));
-			clang_disposeString(s);
-		}
+	if (!img) {
+		send_empty_ac_response(job, partial_len);
+		return;
 	}
-	return chars;
-}
-
-static void sort_cc_results(CXCompletionResult *results, size_t results_n)
-{
-	qsort(results, results_n, sizeof(CXCompletionResult),
-	      (int (*)(const void*,const void*))code_completion_results_cmp);
+	struct response *r = response_cache_put(key, img, img_size);
+	send_ac_response(job, r, sent);
+	response_unref(r);
 }
 
-static str_t *all_results_fmt(CXCompletionResult *results,
-				   size_t results_n)
+static void process_more(struct job *job)
 {
-	if (results_n > WIDTH_SIGNIFICANCE_THRESHOLD)
-		return str_printf("%%%ds %%s", MAX_TYPE_CHARS);
-
-	size_t maxl = 0;
-	for (size_t i = 0; i < results_n; ++i) {
-		if (maxl != MAX_TYPE_CHARS) {
-			size_t l = count_type_chars(&results[i]);
-			if (l > maxl) {
-				if (l > MAX_TYPE_CHARS)
-					maxl = MAX_TYPE_CHARS;
-				else
-					maxl = l;
-			}
-		}
-	}
-	return str_printf("%%%ds %%s", maxl);
+	struct msg_ac_more *msg = &job->msg.more;
+	send_next_page(msg->cursor, msg->page, job->sock);
 }
 
-static size_t filter_out_cc_results(CXCompletionResult *results,
-				    size_t results_n,
-				    str_t *partial,
-				    str_t **fmt)
+static void process_stats(int sock)
 {
-	if (!partial) {
-		*fmt = all_results_fmt(results, results_n);
-		return results_n;
-	}
-
-	size_t maxl = 0;
-	size_t cur = 0;
-	for (size_t i = 0; i < results_n; ++i) {
-		CXString s = get_result_typed_text(&results[i]);
-		if (!s.data)
-			continue;
-		if (!starts_with(clang_getCString(s), partial->data)) {
-			clang_disposeString(s);
-			continue;
-		}
-		clang_disposeString(s);
-
-		CXCompletionResult tmp = results[cur];
-		results[cur] = results[i];
-		results[i] = tmp;
-
-		if (maxl != MAX_TYPE_CHARS) {
-			size_t l = count_type_chars(&results[cur]);
-			if (l > maxl) {
-				if (l > MAX_TYPE_CHARS)
-					maxl = MAX_TYPE_CHARS;
-				else
-					maxl = l;
-			}
-		}
-
-		cur++;
-	}
-	*fmt = str_printf("%%%ds %%s", maxl);
-	return cur;
+	str_t *text = str_printf("requests: %lu\n"
+				 "cancelled: %lu\n"
+				 "results reused: %lu\n"
+				 "preamble hits: %lu\n"
+				 "preamble misses: %lu\n"
+				 "response cache hits: %lu\n"
+				 "response cache misses: %lu\n"
+				 "edits: %lu\n"
+				 "edits resent whole: %lu\n",
+				 stats.requests,
+				 stats.cancelled,
+				 stats.results_reused,
+				 stats.preamble_hits,
+				 stats.preamble_misses,
+				 stats.response_hits,
+				 stats.response_misses,
+				 stats.edits,
+				 stats.resends);
+	msg_stats_response_send(text->data, sock);
+	str_free(text);
 }
 
-static int make_ac_proposal(struct make_ac_ctx *ctx, struct ac_proposal *p,
-			    CXCompletionResult *r, str_t *fmt)
+static void init_group_caps()
 {
-	unsigned int chunks_n;
-
-	chunks_n = clang_getNumCompletionChunks(r->CompletionString);
-	str_clear(ctx->word);
-	str_clear(ctx->abbr);
-	str_clear(ctx->type);
-	str_clear(ctx->text);
-
-	for (unsigned int i = 0; i < chunks_n; ++i) {
-		enum CXCompletionChunkKind kind;
-		CXString s;
-
-		kind = clang_getCompletionChunkKind(r->CompletionString, i);
-		s = clang_getCompletionChunkText(r->CompletionString, i);
-		switch (kind) {
-		case CXCompletionChunk_ResultType:
-			str_add_printf(&ctx->type, "%s", clang_getCString(s));
-			break;
-		case CXCompletionChunk_TypedText:
-			str_add_cstr(&ctx->word, clang_getCString(s));
-		default:
-			str_add_cstr(&ctx->text, clang_getCString(s));
-			break;
-		}
-		clang_disposeString(s);
-	}
+	static const char *names[GROUPS_N] = {
+		[GROUP_MACROS] = "CCODE_MAX_MACROS",
+		[GROUP_FUNCTIONS] = "CCODE_MAX_FUNCTIONS",
+		[GROUP_TYPES] = "CCODE_MAX_TYPES",
+		[GROUP_OTHERS] = "CCODE_MAX_OTHERS",
+	};
 
-	if (ctx->type->len > MAX_TYPE_CHARS) {
-		ctx->type->len = MAX_TYPE_CHARS-1;
-		str_add_cstr(&ctx->type, "…");
+	for (int g = 0; g < GROUPS_N; g++) {
+		int cap = env_int(names[g], RESULT_GROUP_DEFAULT_CAP);
+		group_caps[g] = (cap < 0) ? 0 : cap;
+		if (group_caps[g])
+			group_caps_set = 1;
 	}
-	str_add_printf(&ctx->abbr, fmt->data,
-		       ctx->type->data, ctx->text->data);
-
-	p->abbr = strdup(ctx->abbr->data);
-	p->word = strdup(ctx->word->data);
-	return 1;
 }
 
 static void handle_sigint(int unused)
@@ -505,18 +649,6 @@ static void handle_sigint(int unused)
 	exit(0);
 }
 
-static int wordexps_the_same(wordexp_t *a, wordexp_t *b)
-{
-	if (a->we_wordc != b->we_wordc)
-		return 0;
-
-	for (size_t i = 0; i < a->we_wordc; i++) {
-		if (strcmp(a->we_wordv[i], b->we_wordv[i]) != 0)
-			return 0;
-	}
-	return 1;
-}
-
 void server_main()
 {
 	struct sigaction sa;
@@ -532,12 +664,32 @@ void server_main()
 
 	sa.sa_handler = handle_sigint;
 	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
 	sigaction(SIGINT, &sa, 0);
 
+	// clients may go away before we respond, that's not a reason to die
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, 0);
+
+	init_group_caps();
 	clang_index = clang_createIndex(0, 0);
-	server_loop(sock);
-	if (clang_tu)
-		clang_disposeTranslationUnit(clang_tu);
+	projects_init(env_int("CCODE_FLAGS_TTL", FLAGS_DEFAULT_TTL));
+	tu_cache_init(clang_index, env_int("CCODE_TU_CACHE_SIZE",
+					   TU_CACHE_DEFAULT_SIZE));
+	response_cache_init(env_int("CCODE_RESPONSE_CACHE_SIZE",
+				    RESPONSE_CACHE_DEFAULT_SIZE));
+	cursors_init(env_int("CCODE_CURSOR_TTL", CURSOR_DEFAULT_TTL));
+	pool_start(env_int("CCODE_PARALLEL", sysconf(_SC_NPROCESSORS_ONLN)));
+	workers_start(env_int("CCODE_WORKERS", sysconf(_SC_NPROCESSORS_ONLN)),
+		      process_job);
+	conn_loop(sock);
+	workers_stop();
+	pool_stop();
+	conn_free_all();
+	tu_cache_free();
+	cursors_free();
+	response_cache_free();
+	projects_free();
 	clang_disposeIndex(clang_index);
 
 	close(sock);
@@ -0,0 +1,424 @@
+#pragma once
+
+#include "shared.h"
+#include <pthread.h>
+#include <clang-c/Index.h>
+
+//-------------------------------------------------------------------------
+// Projects
+//-------------------------------------------------------------------------
+
+#define FLAGS_DEFAULT_TTL 300
+
+// Compiler flags, immutable and shared by reference.
+struct flags {
+	int refs;
+	int argc;
+	char **argv;
+};
+
+struct flags *flags_ref(struct flags *f);
+void flags_unref(struct flags *f);
+int flags_equal(struct flags *a, struct flags *b);
+
+struct project;
+
+// 'ttl' is the number of seconds the output of .ccode shell expansion is
+// trusted for, after that it's refreshed in the background
+void projects_init(int ttl);
+void projects_free();
+
+// the project of the directory 'filename' is in, never freed
+struct project *project_get(const char *filename);
+
+// Returns a new reference to the flags from the project's .ccode file. They
+// are expanded again only if the file has changed. Relative paths are
+// resolved against the project's directory.
+struct flags *project_flags(struct project *p);
+
+// the JOB_REFRESH_FLAGS job
+void project_refresh(struct project *p);
+
+//-------------------------------------------------------------------------
+// Thread pool for data parallel work
+//-------------------------------------------------------------------------
+
+// 'n' threads including the callers of parallel_for
+void pool_start(int n);
+void pool_stop();
+int pool_size();
+
+// Calls 'fn' once for every chunk in [0, chunks_n) on the pool's threads and
+// the calling thread, returns when all calls have returned. Any number of
+// threads may call it at the same time.
+void parallel_for(unsigned int chunks_n,
+		  void (*fn)(void *ctx, unsigned int chunk), void *ctx);
+
+//-------------------------------------------------------------------------
+// Completion results
+//-------------------------------------------------------------------------
+
+#define MAX_TYPE_CHARS 20
+
+// Code completion results decoded once, libclang is asked about each result
+// only here. Strings live in the 'text' arena, they are referenced by offset
+// and are null-terminated. Everything else works on arrays of indices.
+struct result_table {
+	unsigned int n;
+	unsigned int *priority;
+	enum CXCursorKind *kind;
+	uint32_t *typed;
+	uint32_t *typed_len;
+	uint32_t *head; // first 4 bytes of typed text, zero padded
+	uint64_t *charset; // see char_bit in results.c
+	uint32_t *type;
+	uint32_t *type_len;
+	uint32_t *display; // all chunks but the result type
+	uint32_t *display_len;
+	uint32_t *id; // hash of the above, stable across completions
+	CXCompletionString *string; // valid while the results are around
+
+	char *text;
+	size_t text_len;
+	size_t text_cap;
+};
+
+struct result_table *result_table_new(CXCodeCompleteResults *results);
+void result_table_free(struct result_table *t);
+
+// a new table with copies of rows 'idx' of 't'
+struct result_table *result_table_subset(struct result_table *t,
+					 unsigned int *idx, unsigned int n);
+// copies all rows of 'src' to the end of 't'
+void result_table_append(struct result_table *t, struct result_table *src);
+
+// Writes indices of results whose typed text starts with 'partial' to 'out',
+// which has room for all of them. Returns how many, stops early if
+// '*cancelled' becomes non-zero.
+unsigned int filter_results(struct result_table *t, str_t *partial,
+			    unsigned int *out, volatile int *cancelled);
+
+// Same for results whose typed text contains 'partial' as a subsequence,
+// their scores go to 'scores', indexed by result.
+unsigned int filter_results_fuzzy(struct result_table *t, str_t *partial,
+				  unsigned int *out, int *scores,
+				  volatile int *cancelled);
+
+// width of the result type column for the results in 'idx'
+int type_column_width(struct result_table *t, str_t *partial,
+		      unsigned int *idx, unsigned int n);
+
+// by score if 'scores' isn't zero, then by priority, then by typed text
+void sort_results(struct result_table *t, unsigned int *idx, unsigned int n,
+		  int *scores);
+
+// Moves the best 'k' of 'n' results to the front of 'idx', both those and
+// the rest are left in no particular order. Linear in 'n' on average.
+void partition_results(struct result_table *t, unsigned int *idx,
+		       unsigned int n, unsigned int k, int *scores);
+
+// The same, but the best 'k' are sorted, in the same order as sort_results.
+void select_results(struct result_table *t, unsigned int *idx, unsigned int n,
+		    unsigned int k, int *scores);
+
+// index of the result with 'id' or -1
+int find_result(struct result_table *t, uint32_t id);
+
+// Describes result 'i' for MSG_RESOLVE, it's looked at only here. The brief
+// comment is there if completion was asked for brief comments.
+void resolve_result(struct msg_resolve_response *out, struct result_table *t,
+		    unsigned int i);
+
+// leaves only results with typed text of length 'len' in 'idx'
+unsigned int keep_exact_matches(struct result_table *t, size_t len,
+				unsigned int *idx, unsigned int n);
+
+// Leaves only the best result of those with the same typed text in 'idx',
+// in the order of the sort functions, the rest keep their order. The size of
+// each group goes to 'counts', indexed by result. Returns how many are left.
+unsigned int collapse_results(struct result_table *t, unsigned int *idx,
+			      unsigned int n, int *scores,
+			      unsigned int *counts);
+
+// Kinds of results with separate caps on how many of them are sent, a few
+// thousand macros shouldn't crowd out everything else.
+enum result_group {
+	GROUP_MACROS,
+	GROUP_FUNCTIONS,
+	GROUP_TYPES,
+	GROUP_OTHERS,
+
+	GROUPS_N
+};
+
+#define RESULT_GROUP_DEFAULT_CAP 0 // no cap unless asked for
+
+enum result_group result_group(enum CXCursorKind kind);
+
+// Leaves at most 'caps[g]' results of each group in 'idx', the first ones,
+// zero means no cap. Returns how many are left.
+unsigned int cap_results(struct result_table *t, unsigned int *idx,
+			 unsigned int n, const unsigned int *caps);
+
+// A MSG_AC_RESPONSE frame for results 'idx', they are formatted straight
+// into it a batch at a time, so that a stream can send each batch right
+// away. The frame is sized for all of them up front, which doesn't depend
+// on their order, the results of a batch have to be in order by the time
+// it's formatted. 'counts' is indexed by result, all counts are 1 if it's
+// zero.
+struct ac_frame {
+	char *data;
+	size_t size;
+	unsigned int formatted; // how many proposals so far
+
+	struct result_table *t;
+	unsigned int *idx;
+	int width;
+	unsigned int *counts;
+	struct bin_proposals p;
+	size_t strings_used;
+};
+
+void ac_frame_init(struct ac_frame *f, int partial, int truncated,
+		   struct result_table *t, unsigned int *idx, unsigned int n,
+		   int width, unsigned int *counts);
+
+// Formats proposals up to 'end', stops early if '*cancelled' becomes
+// non-zero, the frame is garbage then.
+void ac_frame_format(struct ac_frame *f, unsigned int end,
+		     volatile int *cancelled);
+
+//-------------------------------------------------------------------------
+// Translation unit cache
+//-------------------------------------------------------------------------
+
+#define TU_CACHE_DEFAULT_SIZE 4
+
+struct tu_entry {
+	// key, immutable
+	char *filename;
+	struct flags *flags;
+
+	// guarded by the cache lock
+	int refs;
+	unsigned int last_used;
+	struct tu_entry *next;
+
+	// guarded by 'lock'
+	pthread_mutex_t lock;
+	CXTranslationUnit tu;
+	uint64_t preamble_hash;
+
+	// The last code completion results, reused while the user keeps
+	// typing the same identifier. Valid for the same position and the
+	// same buffer outside of the identifier, see 'results_key'.
+	CXCodeCompleteResults *results;
+	struct result_table *table;
+	int results_line;
+	int results_col;
+	uint64_t results_key;
+
+	// Macros are the bulk of most completions and they are the same
+	// everywhere in the file. They are asked for once and kept here,
+	// valid as long as preprocessor directives in the buffer stay the
+	// same, see 'macros_key'. Their strings live in 'macros_results',
+	// which may be 'results' too.
+	struct result_table *macros;
+	CXCodeCompleteResults *macros_results;
+	uint64_t macros_key;
+};
+
+void tu_cache_init(CXIndex index, int size);
+void tu_cache_free();
+
+// Returns a TU for 'filename' parsed with 'flags', parsing it if there is no
+// cached one. Takes over the reference to 'flags' in any case. The precompiled
+// preamble is rebuilt only if the #include block of 'unsaved' has changed
+// since the last call, 'preamble_hit' is set to 1 if it was reused as is.
+//
+// The entry is returned locked, requests for the same TU are serialized
+// this way. Hand it back with tu_cache_release when done.
+struct tu_entry *tu_cache_get(const char *filename, struct flags *flags,
+			      struct CXUnsavedFile *unsaved,
+			      int *preamble_hit);
+void tu_cache_release(struct tu_entry *e);
+
+// Same, but only if there is a parsed TU already, zero otherwise.
+struct tu_entry *tu_cache_find(const char *filename, struct flags *flags);
+
+//-------------------------------------------------------------------------
+// Response cache
+//-------------------------------------------------------------------------
+
+#define RESPONSE_CACHE_DEFAULT_SIZE 16
+
+// A MSG_AC_RESPONSE frame, sent as is when exactly the same request comes
+// again, e.g. when the popup is closed and opened at the same spot.
+struct response {
+	int refs;
+	uint64_t key;
+	size_t size;
+
+	// guarded by the cache lock
+	unsigned int last_used;
+	struct response *next;
+
+	char *data;
+};
+
+void response_cache_init(int size);
+void response_cache_free();
+
+// Returns a reference to the cached response for 'key' or 0. Release it with
+// response_unref.
+struct response *response_cache_get(uint64_t key);
+struct response *response_ref(struct response *r);
+void response_unref(struct response *r);
+
+// Stores 'img', a malloc'ed frame which the response takes over, the least
+// recently used response is dropped if the cache is full. Returns a
+// reference to the response, which is there even if it didn't make it into
+// the cache.
+struct response *response_cache_put(uint64_t key, char *img, size_t size);
+
+//-------------------------------------------------------------------------
+// Cursors
+//-------------------------------------------------------------------------
+
+#define CURSOR_DEFAULT_TTL 30
+#define MAX_CURSORS 16
+#define STREAM_DEFAULT_PAGE 256
+
+// 'ttl' is the number of seconds a cursor is kept after its last use
+void cursors_init(int ttl);
+void cursors_free();
+
+// Sends the first 'page' proposals of the MSG_AC_RESPONSE 'r', all of them
+// if 'page' is zero, as a binary frame if 'binary' is set. The rest is kept
+// behind a cursor, which is sent along, MSG_AC_MORE asks for the next pages,
+// those are always tpl images. Only MAX_CURSORS are kept, the least recently
+// used one is dropped to make room.
+void send_first_page(struct response *r, int page, int binary, int sock);
+
+// Sends the next 'page' proposals behind 'cursor', the cursor stays valid
+// if there are more. An empty AC_CANCELLED response if it has expired.
+void send_next_page(int cursor, int page, int sock);
+
+// Sends the proposals of 'r' starting with 'first' as a stream of responses,
+// 'page' proposals each, for AC_STREAM. All but the last have AC_STREAMED
+// as the cursor.
+void send_stream(struct response *r, uint32_t first, int page, int binary,
+		 int sock);
+
+//-------------------------------------------------------------------------
+// Delta responses
+//-------------------------------------------------------------------------
+
+// Sends the MSG_AC_RESPONSE 'r' as a MSG_AC_DELTA_RESPONSE relative to
+// '*base', the last response sent this way, zero if none, as a binary frame
+// if 'binary' is set. 'r' becomes the base then, it's referenced by it.
+void send_delta(struct response *r, struct response **base, int binary,
+		int sock);
+
+// An empty one, which drops the base unless it's AC_CANCELLED or
+// AC_RESEND.
+void send_empty_delta(int partial, struct response **base, int binary,
+		      int sock);
+
+//-------------------------------------------------------------------------
+// Kept buffers
+//-------------------------------------------------------------------------
+
+#define MAX_KEPT_BUFFERS 8
+
+// The last buffer a connection has sent with AC_KEEP or AC_EDIT, for each of
+// up to MAX_KEPT_BUFFERS files. The least recently used one is dropped to
+// make room.
+struct kept_buffer;
+
+// Applies an AC_EDIT to the buffer kept for the file, 'msg' carries the
+// whole buffer afterwards. The result is kept, so is the buffer of AC_KEEP,
+// the kept one is dropped otherwise. Returns -1 if there is nothing to apply
+// the edit to or the result doesn't match the hash.
+int apply_edit(struct kept_buffer **kept, struct msg_ac *msg);
+void free_kept_buffers(struct kept_buffer *kept);
+
+//-------------------------------------------------------------------------
+// Stats
+//-------------------------------------------------------------------------
+
+struct server_stats {
+	unsigned long requests;
+	unsigned long cancelled;
+	unsigned long results_reused;
+	unsigned long preamble_hits;
+	unsigned long preamble_misses;
+	unsigned long response_hits;
+	unsigned long response_misses;
+	unsigned long edits;
+	unsigned long resends;
+};
+
+extern struct server_stats stats;
+
+#define STATS_INC(field) __sync_fetch_and_add(&stats.field, 1)
+
+//-------------------------------------------------------------------------
+// Worker pool
+//-------------------------------------------------------------------------
+
+struct conn;
+
+// internal jobs, not coming from clients
+#define JOB_REFRESH_FLAGS	-1
+
+struct job {
+	struct conn *conn; // zero if nobody waits for a response
+	int sock;
+	int msg_type;
+	union {
+		struct msg_ac ac;
+		struct msg_open open;
+		struct msg_resolve resolve;
+		struct msg_ac_more more;
+		struct project *project;
+	} msg;
+
+	// the request came as a binary frame, so does the response
+	int binary;
+
+	// set when a newer request of the same client for the same file
+	// arrives, the result isn't interesting to anyone at that point
+	volatile int cancelled;
+
+	struct job *next;
+};
+
+void workers_start(int n, void (*handler)(struct job *job));
+void workers_push(struct job *job);
+
+// lets the workers finish queued jobs and joins them
+void workers_stop();
+
+//-------------------------------------------------------------------------
+// Connections
+//-------------------------------------------------------------------------
+
+// Serves clients connecting to the listening 'sock' until MSG_CLOSE or a
+// long enough period without connections. Every message becomes a job for the
+// worker pool, messages of one connection are handled one at a time and in
+// order, so responses come back in order too. A new MSG_AC cancels the
+// connection's queued and running MSG_AC jobs for the same file.
+void conn_loop(int sock);
+
+// the worker is done with the job, frees it
+void conn_job_done(struct job *job);
+
+// The last response sent to the connection with send_delta. Only the job the
+// connection is busy with may touch it.
+struct response **conn_delta_base(struct conn *c);
+
+// same for the buffers kept by apply_edit
+struct kept_buffer **conn_kept_buffers(struct conn *c);
+
+void conn_free_all();
@@ -2,6 +2,7 @@
 
 #include "strstr.h"
 #include "tpl.h"
+#include <sys/uio.h>
 
 //-------------------------------------------------------------------------
 // Protocol
@@ -16,38 +17,322 @@ tpl_node *msg_node_pack(int msgtype);
 // AC (autocompletion)
 
 #define MSG_AC			1
-#define MSG_AC_FMT		"Bsii"
+#define MSG_AC_FMT		"BsiiiiiiiU"
+
+// flags
+#define AC_FUZZY		1 // subsequence matching, ranked by score
+#define AC_UNSORTED_TAIL	2 // results past the limit follow, unsorted
+#define AC_COLLAPSE		4 // one result per typed text, with a count
+#define AC_EXACT		8 // only results equal to the partial identifier
+#define AC_STREAM		16 // several responses of 'page' proposals each
+#define AC_DELTA		32 // MSG_AC_DELTA_RESPONSE instead, never paged
+#define AC_KEEP			64 // the server keeps the buffer for AC_EDIT
+#define AC_EDIT			128 // the buffer is an edit of the kept one
 
 struct msg_ac {
 	tpl_bin buffer;
 	char *filename;
 	int line;
 	int col;
+	int flags;
+	int limit; // how many best results to sort and send, 0 for all
+	int page; // how many proposals to send right away, 0 for all
+
+	// With AC_EDIT the buffer replaces lines [edit_start, edit_end) of the
+	// one kept for the file on this connection, 'hash' is hash_bytes of
+	// the result. The result is kept in turn.
+	int edit_start;
+	int edit_end;
+	uint64_t hash;
 };
 
 tpl_node *msg_ac_node(struct msg_ac *msg);
 void free_msg_ac(struct msg_ac *msg);
 
-// AC_RESPONSE
+// AC_RESPONSE (partial is AC_CANCELLED if a newer request has superseded it,
+// or AC_RESEND if an AC_EDIT didn't apply and the whole buffer is needed,
+// truncated is 1 if there were more results than sent, cursor is non-zero if
+// there are more proposals than in this page, see MSG_AC_MORE, or
+// AC_STREAMED if they follow in the next response)
 
 #define MSG_AC_RESPONSE		2
-#define MSG_AC_RESPONSE_FMT	"iA(S(ss))"
+#define MSG_AC_RESPONSE_FMT	"iiiA(S(ssii))"
+#define AC_CANCELLED		-1
+#define AC_RESEND		-2
+#define AC_STREAMED		-1
 
 struct ac_proposal {
 	char *word;
 	char *abbr;
+	int count; // how many results have this word, if collapsed
+	int id; // for MSG_RESOLVE
 };
 
 struct msg_ac_response {
 	int partial;
+	int truncated;
+	int cursor;
 	struct ac_proposal *proposals;
 	size_t proposals_n;
+
+	// strings aren't owned, see msg_ac_response_recv_bin
+	int borrowed;
 };
 
-void msg_ac_response_send(struct msg_ac_response *msg, int sock);
-void msg_ac_response_recv(struct msg_ac_response *msg, int sock);
+int msg_ac_response_recv(struct msg_ac_response *msg, int sock);
 void free_msg_ac_response(struct msg_ac_response *msg);
 
+// AC_DELTA_RESPONSE (the response to MSG_AC with AC_DELTA, relative to the
+// last one of those on the same connection which wasn't AC_CANCELLED)
+//
+// Proposals which were there last time aren't sent again. For each proposal
+// of the full list 'refs' has its index in the last list, or -1 if it's the
+// next one of 'proposals'.
+
+#define MSG_AC_DELTA_RESPONSE	8 // the type of its binary frame
+#define MSG_AC_DELTA_RESPONSE_FMT "iiA(i)A(S(ssii))"
+
+struct msg_ac_delta_response {
+	int partial;
+	int truncated;
+	int *refs;
+	size_t refs_n;
+
+	// strings aren't owned, see msg_ac_delta_response_recv_bin
+	struct ac_proposal *proposals;
+	size_t proposals_n;
+};
+
+void free_msg_ac_delta_response(struct msg_ac_delta_response *msg);
+
+// STATS (followed by a response: human readable text)
+
+#define MSG_STATS		3
+#define MSG_STATS_RESPONSE_FMT	"s"
+
+void msg_stats_response_send(char *text, int sock);
+char *msg_stats_response_recv(int sock);
+
+// OPEN (parse a file in advance, there is no response)
+
+#define MSG_OPEN		4
+#define MSG_OPEN_FMT		"Bs"
+
+struct msg_open {
+	tpl_bin buffer;
+	char *filename;
+};
+
+tpl_node *msg_open_node(struct msg_open *msg);
+void free_msg_open(struct msg_open *msg);
+
+// RESOLVE (details of a proposal from the last completion of the file,
+// followed by a response)
+//
+// Only ids from the latest completion which was actually run resolve. A
+// response from the response cache doesn't bring its results back, its ids
+// resolve only if the latest completion has the same results, otherwise
+// they are gone.
+
+#define MSG_RESOLVE		5
+#define MSG_RESOLVE_FMT		"si"
+
+struct msg_resolve {
+	char *filename;
+	int id;
+};
+
+tpl_node *msg_resolve_node(struct msg_resolve *msg);
+void free_msg_resolve(struct msg_resolve *msg);
+
+// RESOLVE_RESPONSE (availability is -1 and strings are zero if the proposal
+// is gone)
+
+#define MSG_RESOLVE_RESPONSE_FMT "isss"
+
+struct msg_resolve_response {
+	int availability; // enum CXAvailabilityKind
+	char *signature; // with the result type and optional parameters
+	char *comment; // brief doc comment
+	char *parent; // name of the enclosing context
+};
+
+void msg_resolve_response_send(struct msg_resolve_response *msg, int sock);
+int msg_resolve_response_recv(struct msg_resolve_response *msg, int sock);
+void free_msg_resolve_response(struct msg_resolve_response *msg);
+
+// AC_MORE (the next page of proposals behind a cursor, followed by
+// MSG_AC_RESPONSE, its partial is AC_CANCELLED if the cursor has expired)
+
+#define MSG_AC_MORE		6
+#define MSG_AC_MORE_FMT		"ii"
+
+struct msg_ac_more {
+	int cursor;
+	int page;
+};
+
+tpl_node *msg_ac_more_node(struct msg_ac_more *msg);
+
+// VERSION (followed by a response: PROTOCOL_VERSION of the daemon)
+//
+// Clients ask right after connecting. A daemon which answers something else,
+// or closes the connection because it's older than this message, is sent
+// MSG_CLOSE and a new one is started. The type image and MSG_CLOSE stay as
+// they are for that to work with any daemon.
+
+#define MSG_VERSION		7
+#define MSG_VERSION_RESPONSE_FMT "i"
+
+// bumped whenever the format of any of the messages above or of the binary
+// frames below changes
+#define PROTOCOL_VERSION	2
+
+void msg_version_response_send(int sock);
+
+// PROTOCOL_VERSION of the daemon, -1 if it doesn't know MSG_VERSION
+int msg_version_response_recv(int sock);
+
+//-------------------------------------------------------------------------
+// Binary framing
+//-------------------------------------------------------------------------
+
+// MSG_AC and its MSG_AC_RESPONSE or MSG_AC_DELTA_RESPONSE can also go as a
+// single binary frame each, there is nothing to map and no per-field copies.
+// A frame starts with bin_header, its first 8 bytes are laid out like the
+// start of a tpl image: BIN_MAGIC and the version instead of "tpl" and
+// flags, then the size of the whole frame. That's how the server tells the
+// two apart, the response is framed the same way as the request. Both ends
+// are on the same machine, integers are in its byte order.
+
+#define BIN_MAGIC		"ccb"
+#define BIN_VERSION		3
+
+struct bin_header {
+	char magic[3];
+	uint8_t version;
+	uint32_t size;
+	int32_t msg_type;
+};
+
+// MSG_AC: followed by the filename and the buffer, neither of them is null
+// terminated.
+struct bin_ac {
+	uint64_t hash;
+	int32_t line;
+	int32_t col;
+	int32_t flags;
+	int32_t limit;
+	int32_t page;
+	int32_t edit_start;
+	int32_t edit_end;
+	uint32_t filename_len;
+	uint32_t buffer_len;
+};
+
+// MSG_AC_RESPONSE: followed by 'proposals_n' word offsets, as many abbr
+// offsets, counts and ids, then the string table. Offsets point into the
+// string table, which is 'strings_size' bytes of null terminated strings.
+// The strings of each proposal follow those of the one before it, its word
+// first, then its abbr.
+struct bin_ac_response {
+	int32_t partial;
+	int32_t truncated;
+	int32_t cursor;
+	uint32_t proposals_n;
+	uint32_t strings_size;
+};
+
+// MSG_AC_DELTA_RESPONSE: followed by 'refs_n' refs, then the new proposals,
+// laid out like those of MSG_AC_RESPONSE.
+struct bin_ac_delta_response {
+	int32_t partial;
+	int32_t truncated;
+	uint32_t refs_n;
+	uint32_t proposals_n;
+	uint32_t strings_size;
+};
+
+// Where the proposals of a frame are. The server builds responses as binary
+// frames right away, tpl images are made from them for clients which don't
+// send binary frames. Its frames are malloc'ed, so the arrays are aligned,
+// the headers are a multiple of 4 bytes.
+struct bin_proposals {
+	uint32_t n;
+	uint32_t *words;
+	uint32_t *abbrs;
+	int32_t *counts;
+	int32_t *ids;
+	char *strings;
+	uint32_t strings_size;
+};
+
+// A MSG_AC_RESPONSE frame with room for 'proposals_n' proposals and
+// 'strings_size' bytes of strings, see 'p' for where they go.
+char *bin_ac_response_new(size_t *size, struct bin_proposals *p, int partial,
+			  int truncated, int cursor, uint32_t proposals_n,
+			  size_t strings_size);
+
+// The same for MSG_AC_DELTA_RESPONSE, 'refs_n' refs go to 'refs'.
+char *bin_ac_delta_response_new(size_t *size, int32_t **refs,
+				struct bin_proposals *p, int partial,
+				int truncated, uint32_t refs_n,
+				uint32_t proposals_n, size_t strings_size);
+
+// The other way around, for frames made by bin_ac_response_new.
+void bin_ac_response_get(char *frame, struct bin_ac_response *r,
+			 struct bin_proposals *p);
+
+// where the strings of proposal 'i' end, the ones after it don't have to be
+// there yet
+uint32_t bin_proposal_end(struct bin_proposals *p, uint32_t i);
+
+// Receive buffer for frames, tpl images and binary frames alike, reused for
+// everything read from one socket. A read takes as much as there is room
+// for, whatever comes after a frame waits for frame_next.
+struct frame_buffer {
+	char *data;
+	size_t start; // of the first frame which hasn't been taken yet
+	size_t len;
+	size_t cap;
+};
+
+#define FRAME_BUFFER_MIN (64 * 1024)
+
+// Drops the frames taken so far and reads more, grows the buffer to fit the
+// frame being read. Returns what read returns.
+ssize_t frame_read(struct frame_buffer *b, int fd);
+
+// Takes the next frame if it's all there and returns 1, 0 if it's not,
+// -1 if it's neither a tpl image nor a binary frame of BIN_VERSION. The
+// frame stays valid until the next frame_read.
+int frame_next(struct frame_buffer *b, const char **frame, size_t *size);
+void free_frame_buffer(struct frame_buffer *b);
+
+int msg_ac_send_bin(struct msg_ac *msg, int sock);
+
+// fills 'msg' with copies of the filename and the buffer, -1 if malformed
+int msg_ac_from_bin(struct msg_ac *msg, const char *frame, size_t size);
+
+// Sends a frame made by bin_ac_response_new as it is if 'binary' is set, or
+// converted to a tpl image.
+int ac_response_send(char *frame, size_t size, int binary, int sock);
+
+// The same for 'n' of its proposals starting with 'first', with 'cursor'
+// instead of its own. Only the offsets are copied for a binary frame.
+int ac_response_send_part(char *frame, uint32_t first, uint32_t n,
+			  int cursor, int binary, int sock);
+
+// The same for a frame made by bin_ac_delta_response_new.
+int ac_delta_response_send(char *frame, size_t size, int binary, int sock);
+
+// Proposals point into the frame buffer, they are valid until the next
+// frame_read, see 'borrowed'.
+int msg_ac_response_recv_bin(struct msg_ac_response *msg,
+			     struct frame_buffer *b, int sock);
+int msg_ac_delta_response_recv_bin(struct msg_ac_delta_response *msg,
+				   struct frame_buffer *b, int sock);
+
 //-------------------------------------------------------------------------
 // Misc
 //-------------------------------------------------------------------------
@@ -59,7 +344,34 @@ int starts_with(const char *s1, const char *s2);
 int read_file(void **out, size_t *size, const char *filename);
 int read_stdin(void **out, size_t *size);
 
+// writes everything, waits if 'fd' is non-blocking, 0 on success, -1 on error
+int write_all(int fd, const void *buf, size_t size);
+
+// same for 'iovcnt' buffers at once, modifies 'iov'
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+
+// 'fd' isn't inherited by processes the server spawns, 0 on success
+int set_cloexec(int fd);
+
+// Replaces lines [start, end) of '*data', counting from zero, with 'text' in
+// place, only what's below them moves. -1 if there are fewer lines, the
+// last line doesn't need a newline.
+int replace_lines(char **data, size_t *size, int start, int end,
+		  const char *text, size_t text_size);
+
 str_t *get_socket_path();
 
+// integer value of an environment variable or 'def' if it's not set
+int env_int(const char *name, int def);
+
+// FNV-1a, pass HASH_INIT as 'h' or a result of a previous call to continue
+#define HASH_INIT 14695981039346656037ULL
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len);
+
 void client_main(int argc, char **argv);
 void server_main();
+
+// 'ccode -expand <dir> <words>', the server runs .ccode through it: writes
+// the words expanded by wordexp in 'dir' to stdout, each followed by '\0'.
+// Returns the exit status.
+int expand_main(const char *dir, const char *words);
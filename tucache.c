@@ -0,0 +1,292 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+
+// for reference
+static struct tu_entry *new_tu_entry(const char *filename, struct flags *flags);
+static void free_tu_entry(struct tu_entry *e);
+static struct tu_entry *find_tu_entry(const char *filename,
+				      struct flags *flags);
+static void unlink_tu_entry(struct tu_entry *e);
+static struct tu_entry *evict_lru_entries();
+static size_t preamble_size(const char *buf, size_t len);
+static uint64_t preamble_hash(struct CXUnsavedFile *unsaved);
+static int reparse(struct tu_entry *e, struct CXUnsavedFile *unsaved);
+static void drop_results(struct tu_entry *e);
+
+//-------------------------------------------------------------------------
+
+// Protects the list and the 'refs' and 'last_used' fields of entries. The
+// TU itself is protected by the entry's own lock, which is never acquired
+// while 'cache_lock' is held.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CXIndex clang_index;
+static struct tu_entry *entries;
+static int entries_n;
+static int max_entries;
+static unsigned int use_counter;
+
+void tu_cache_init(CXIndex index, int size)
+{
+	if (size < 1)
+		size = 1;
+
+	clang_index = index;
+	max_entries = size;
+}
+
+void tu_cache_free()
+{
+	while (entries) {
+		struct tu_entry *e = entries;
+		unlink_tu_entry(e);
+		free_tu_entry(e);
+	}
+}
+
+static struct tu_entry *new_tu_entry(const char *filename, struct flags *flags)
+{
+	struct tu_entry *e = calloc(1, sizeof(struct tu_entry));
+	pthread_mutex_init(&e->lock, 0);
+	e->filename = strdup(filename);
+	e->flags = flags;
+
+	e->next = entries;
+	entries = e;
+	entries_n++;
+	return e;
+}
+
+static void free_tu_entry(struct tu_entry *e)
+{
+	drop_results(e);
+	if (e->tu)
+		clang_disposeTranslationUnit(e->tu);
+	free(e->filename);
+	flags_unref(e->flags);
+	pthread_mutex_destroy(&e->lock);
+	free(e);
+}
+
+static struct tu_entry *find_tu_entry(const char *filename,
+				      struct flags *flags)
+{
+	for (struct tu_entry *e = entries; e; e = e->next) {
+		if (strcmp(e->filename, filename) != 0)
+			continue;
+		if (!flags_equal(e->flags, flags))
+			continue;
+		return e;
+	}
+	return 0;
+}
+
+static void unlink_tu_entry(struct tu_entry *e)
+{
+	struct tu_entry **pe = &entries;
+	while (*pe != e)
+		pe = &(*pe)->next;
+	*pe = e->next;
+	e->next = 0;
+	entries_n--;
+}
+
+// Makes room for one more entry by unlinking least recently used entries
+// nobody is working with. Returns them as a list, they are freed outside of
+// the cache lock. If all entries are busy, the cache grows temporarily.
+static struct tu_entry *evict_lru_entries()
+{
+	struct tu_entry *evicted = 0;
+
+	while (entries_n >= max_entries) {
+		struct tu_entry *lru = 0;
+		for (struct tu_entry *e = entries; e; e = e->next) {
+			if (e->refs)
+				continue;
+			if (!lru || e->last_used < lru->last_used)
+				lru = e;
+		}
+		if (!lru)
+			break;
+
+		unlink_tu_entry(lru);
+		lru->next = evicted;
+		evicted = lru;
+	}
+	return evicted;
+}
+
+// Size of the leading block of preprocessor directives, comments and
+// whitespace. That's roughly what clang puts into the precompiled preamble,
+// everything after it is reparsed on each request anyway.
+static size_t preamble_size(const char *buf, size_t len)
+{
+	const char *c = buf;
+	const char *end = buf + len;
+	const char *last = buf;
+
+	while (c != end) {
+		if (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') {
+			c++;
+		} else if (*c == '#') {
+			// directive, up to the first newline not escaped by '\'
+			while (c != end && *c != '\n') {
+				if (*c == '\\' && c + 1 != end)
+					c++;
+				c++;
+			}
+			last = c;
+		} else if (*c == '/' && c + 1 != end && c[1] == '/') {
+			while (c != end && *c != '\n')
+				c++;
+		} else if (*c == '/' && c + 1 != end && c[1] == '*') {
+			c += 2;
+			while (c != end && !(*c == '*' && c + 1 != end && c[1] == '/'))
+				c++;
+			if (c != end)
+				c += 2;
+		} else {
+			break;
+		}
+	}
+	return last - buf;
+}
+
+static uint64_t preamble_hash(struct CXUnsavedFile *unsaved)
+{
+	size_t size = preamble_size(unsaved->Contents, unsaved->Length);
+	return hash_bytes(HASH_INIT, unsaved->Contents, size);
+}
+
+static void drop_results(struct tu_entry *e)
+{
+	if (e->results && e->results != e->macros_results)
+		clang_disposeCodeCompleteResults(e->results);
+	e->results = 0;
+	if (e->macros_results) {
+		clang_disposeCodeCompleteResults(e->macros_results);
+		e->macros_results = 0;
+	}
+	if (e->table) {
+		result_table_free(e->table);
+		e->table = 0;
+	}
+	if (e->macros) {
+		result_table_free(e->macros);
+		e->macros = 0;
+	}
+}
+
+// On failure the TU is no longer valid, it's disposed of then.
+static int reparse(struct tu_entry *e, struct CXUnsavedFile *unsaved)
+{
+	// the headers have changed, so may have the completions
+	drop_results(e);
+	if (clang_reparseTranslationUnit(e->tu, 1, unsaved,
+					 clang_defaultReparseOptions(e->tu)) != 0) {
+		clang_disposeTranslationUnit(e->tu);
+		e->tu = 0;
+		return -1;
+	}
+	e->preamble_hash = preamble_hash(unsaved);
+	return 0;
+}
+
+struct tu_entry *tu_cache_get(const char *filename, struct flags *flags,
+			      struct CXUnsavedFile *unsaved,
+			      int *preamble_hit)
+{
+	struct tu_entry *e, *evicted = 0;
+
+	*preamble_hit = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	e = find_tu_entry(filename, flags);
+	if (e) {
+		flags_unref(flags);
+	} else {
+		evicted = evict_lru_entries();
+		e = new_tu_entry(filename, flags);
+	}
+	e->refs++;
+	e->last_used = ++use_counter;
+	pthread_mutex_unlock(&cache_lock);
+
+	while (evicted) {
+		struct tu_entry *next = evicted->next;
+		free_tu_entry(evicted);
+		evicted = next;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	if (e->tu) {
+		// Code completion reuses the preamble as long as it's valid,
+		// but it never rebuilds it. Reparse explicitly when the
+		// #include block was touched, otherwise leave the TU as is.
+		if (preamble_hash(unsaved) == e->preamble_hash) {
+			*preamble_hit = 1;
+			return e;
+		}
+		if (reparse(e, unsaved) == -1)
+			goto fail;
+		return e;
+	}
+
+	// A new entry or the previous parse has failed. The precompiled
+	// preamble is built right away, not on the first reparse.
+	if (clang_parseTranslationUnit2(clang_index, filename,
+					(char const * const *)e->flags->argv,
+					e->flags->argc,
+					unsaved, 1,
+					clang_defaultEditingTranslationUnitOptions() |
+					CXTranslationUnit_PrecompiledPreamble |
+					CXTranslationUnit_CreatePreambleOnFirstParse |
+					CXTranslationUnit_IncludeBriefCommentsInCodeCompletion,
+					&e->tu) != CXError_Success) {
+		e->tu = 0;
+		goto fail;
+	}
+	e->preamble_hash = preamble_hash(unsaved);
+	return e;
+fail:
+	tu_cache_release(e);
+	return 0;
+}
+
+struct tu_entry *tu_cache_find(const char *filename, struct flags *flags)
+{
+	struct tu_entry *e;
+
+	pthread_mutex_lock(&cache_lock);
+	e = find_tu_entry(filename, flags);
+	if (e)
+		e->refs++;
+	pthread_mutex_unlock(&cache_lock);
+	flags_unref(flags);
+
+	if (!e)
+		return 0;
+	pthread_mutex_lock(&e->lock);
+	if (!e->tu) {
+		tu_cache_release(e);
+		return 0;
+	}
+	return e;
+}
+
+void tu_cache_release(struct tu_entry *e)
+{
+	pthread_mutex_unlock(&e->lock);
+
+	pthread_mutex_lock(&cache_lock);
+	// nobody else can touch the entry when there are no refs left
+	if (--e->refs == 0 && !e->tu)
+		unlink_tu_entry(e);
+	else
+		e = 0;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (e)
+		free_tu_entry(e);
+}
@@ -1,4 +1,4 @@
 #!/bin/bash
-clang -o ccode -L$(llvm-config --libdir) -lclang client.c server.c misc.c main.c strstr.c tpl.c proto.c
+clang -o ccode -L$(llvm-config --libdir) -lclang client.c server.c misc.c main.c strstr.c tpl.c proto.c tucache.c workers.c conn.c project.c results.c pool.c respcache.c cursors.c delta.c edits.c -lpthread
 cp ccode ~/bin
 
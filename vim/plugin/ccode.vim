@@ -16,7 +16,37 @@ fu! s:system(str, ...)
 	return (a:0 == 0 ? system(a:str) : system(a:str, join(a:000)))
 endf
 
+" With +job a single 'ccode pipe' process is kept around, it talks to the
+" daemon over one persistent connection instead of connecting per request.
+let s:job_n = 0
+
+fu! s:ccodeChannel()
+	if !exists('s:job') || job_status(s:job) != 'run'
+		let s:job = job_start(['ccode', 'pipe'], {'mode': 'nl'})
+		let s:job_n += 1
+	endif
+	return job_getchannel(s:job)
+endf
+
 fu! s:ccodeCommand(cmd, args)
+	if has('job')
+		let ch = s:ccodeChannel()
+		if ch_status(ch) == 'open'
+			" ch_evalraw() may return only a part of a long line,
+			" ch_read() waits for all of it
+			let line = join([a:cmd] + a:args, "\t") . "\n"
+			call ch_sendraw(ch, line)
+			let result = ch_read(ch, {'timeout': 60000})
+			if result == '' && a:cmd == 'ac'
+				" the response may still come, a new
+				" connection starts with a clean slate
+				call job_stop(s:job)
+				return "[\"0\", []]"
+			endif
+			return result
+		endif
+	endif
+
 	for i in range(0, len(a:args) - 1)
 		let a:args[i] = shellescape(a:args[i])
 	endfor
@@ -37,26 +67,255 @@ fu! s:ccodeCol()
 	return printf('%d', col('.'))
 endf
 
+" With listener_add() only the lines changed since the last completion are
+" sent, 'ccode pipe' keeps the rest. b:ccode_sync is what it has: lines
+" [top, end_cur) replace lines [top, end_orig) of what was sent last time,
+" top is 0 if nothing has changed.
+fu! s:ccodeEditing()
+	return has('job') && exists('*listener_add')
+endf
+
+fu! s:ccodeListen(bufnr, start, end, added, changes)
+	let sync = getbufvar(a:bufnr, 'ccode_sync', {})
+	if empty(sync)
+		return
+	endif
+	for c in a:changes
+		if !sync.top
+			let sync.top = c.lnum
+			let sync.end_cur = c.end
+			let sync.end_orig = c.end
+		endif
+		let sync.top = min([sync.top, c.lnum])
+		if c.end > sync.end_cur
+			let sync.end_orig += c.end - sync.end_cur
+			let sync.end_cur = c.end
+		endif
+		let sync.end_cur += c.added
+	endfor
+endf
+
+" Returns the options and the file for 'ac', the file has only the changed
+" lines unless 'whole' is set or the pipe has been restarted meanwhile.
+fu! s:ccodeBuffer(whole)
+	if !s:ccodeEditing()
+		return [[], s:ccodeCurrentBuffer()]
+	endif
+	if !exists('b:ccode_listener')
+		let b:ccode_listener = listener_add(function('s:ccodeListen'))
+	endif
+	call listener_flush()
+	call s:ccodeChannel()
+
+	let sync = get(b:, 'ccode_sync', {})
+	if a:whole || empty(sync) || sync.job != s:job_n
+		let b:ccode_sync = {'job': s:job_n, 'top': 0}
+		return [[], s:ccodeCurrentBuffer()]
+	endif
+
+	let file = tempname()
+	if sync.top
+		call writefile(getline(sync.top, sync.end_cur - 1), file)
+		let opts = ['-edit', string(sync.top - 1), string(sync.end_orig - 1)]
+	else
+		call writefile([], file)
+		let opts = ['-edit', '0', '0']
+	endif
+	let sync.top = 0
+	return [opts, file]
+endf
+
+" 'ac' at the cursor, the whole buffer is sent again if the changed lines
+" weren't enough
+fu! s:ccodeAc(opts)
+	for whole in [0, 1]
+		let [edit, filename] = s:ccodeBuffer(whole)
+		let result = s:ccodeCommand('ac', a:opts + edit +
+					   \ [expand('%:p'), s:ccodeLine(),
+					   \ s:ccodeCol(), filename])
+		call delete(filename)
+		if result !~# '^\[-2,'
+			break
+		endif
+	endfor
+	return result
+endf
+
+" let g:ccode_fuzzy = 1 to match subsequences, e.g. 'sad' for 'str_add_cstr'
+" let g:ccode_limit = N to get only the N best results
+" let g:ccode_collapse = 1 to get one result per name, see s:ccodeVariants
+" let g:ccode_resolve = 1 to see details of the selected result in a popup
+" let g:ccode_page = N to see the N best results right away, see s:ccodeMore
 fu! s:ccodeAutocomplete()
+	let opts = get(g:, 'ccode_fuzzy', 0) ? ['-fuzzy'] : []
+	if s:ccodeResolving()
+		let opts += ['-ids']
+	endif
+	" 'more' prints the rest the same way
+	let s:more_opts = copy(opts)
+	if get(g:, 'ccode_collapse', 0)
+		let opts += ['-collapse']
+	endif
+	if get(g:, 'ccode_limit', 0) > 0
+		let opts += ['-limit', string(g:ccode_limit)]
+	endif
+	" proposals from the last list come as their index in it
+	let s:delta = has('job') && !s:ccodePaging()
+	if s:ccodePaging()
+		let opts += ['-page', string(g:ccode_page)]
+	elseif s:delta
+		let opts += ['-delta']
+	endif
+	return s:ccodeAc(opts)
+endf
+
+" parse the file in advance, so that the first completion doesn't have to, once
+" per buffer and always from the buffer itself, it may not be on disk yet
+fu! s:ccodeOpen()
+	if bufname('%') == '' || exists('b:ccode_opened')
+		return
+	endif
+	let b:ccode_opened = 1
 	let filename = s:ccodeCurrentBuffer()
-	let result = s:ccodeCommand('ac', [bufname('%'),
-				   \ s:ccodeLine(), s:ccodeCol(),
-				   \ filename])
+	call s:ccodeCommand('open', [expand('%:p'), filename])
 	call delete(filename)
-	return result
 endf
 
 fu! CCodeComplete(findstart, base)
 	"findstart = 1 when we need to get the text length
 	if a:findstart == 1
 		execute "silent let g:ccode_completions = " . s:ccodeAutocomplete()
-		return col('.') - g:ccode_completions[0] - 1
+		if s:delta
+			call s:ccodeUndelta(g:ccode_completions)
+		endif
+		let s:start = col('.') - g:ccode_completions[0]
+		return s:start - 1
 	"findstart = 0 when we need to return the list of completions
 	else
-		return g:ccode_completions[1]
+		let cursor = get(g:ccode_completions, 3, 0)
+		let s:more = {}
+		if !cursor
+			" some results were left out, those which match what
+			" the user types next are only there if vim asks again
+			if get(g:ccode_completions, 2, 0)
+				return {'words': g:ccode_completions[1],
+				      \ 'refresh': 'always'}
+			endif
+			return g:ccode_completions[1]
+		endif
+
+		" the rest comes once the popup is there, vim asks again when
+		" the user types meanwhile, only the first page would be
+		" filtered otherwise
+		let s:more = {'cursor': cursor, 'base': a:base,
+			    \ 'items': copy(g:ccode_completions[1])}
+		return {'words': g:ccode_completions[1], 'refresh': 'always'}
+	endif
+endf
+
+let s:last = []
+
+fu! s:ccodeUndelta(completions)
+	call map(a:completions[1], 'type(v:val) == type(0) ? s:last[v:val] : v:val')
+	if a:completions[0] != -1
+		let s:last = a:completions[1]
+	endif
+endf
+
+fu! s:ccodePaging()
+	return get(g:, 'ccode_page', 0) > 0 && has('timers') &&
+				\ exists('*complete_info') && exists('##CompleteChanged')
+endf
+
+" complete() can't be called while the menu is being drawn
+fu! s:ccodeMoreLater()
+	if exists('s:more') && !empty(s:more)
+		call timer_start(0, function('s:ccodeMore'))
+	endif
+endf
+
+" Fetches the rest of a paged completion and shows all of it, unless the user
+" has typed or selected something meanwhile. Works best with noselect in
+" 'completeopt', vim selects the first result otherwise.
+fu! s:ccodeMore(timer)
+	let more = s:more
+	let s:more = {}
+	if empty(more) || mode() !=# 'i' || !pumvisible()
+		return
+	endif
+
+	while more.cursor
+		execute "silent let result = " . s:ccodeCommand('more',
+					\ s:more_opts + [string(more.cursor),
+					\ string(g:ccode_page)])
+		let more.items += result[1]
+		let more.cursor = get(result, 3, 0)
+	endwhile
+
+	let typed = strpart(getline('.'), s:start - 1, col('.') - s:start)
+	if !pumvisible() || typed !=# more.base ||
+				\ complete_info(['selected']).selected != -1
+		return
+	endif
+	call complete(s:start, more.items)
+endf
+
+" all results named exactly like the identifier before the cursor, e.g. to
+" see the rest of a collapsed group
+fu! s:ccodeVariants()
+	execute "silent let variants = " . s:ccodeAc(['-exact'])
+	call complete(col('.') - variants[0], variants[1])
+	return ''
+endf
+
+inoremap <silent> <Plug>(ccode-variants) <C-r>=<SID>ccodeVariants()<CR>
+
+fu! s:ccodeResolving()
+	return get(g:, 'ccode_resolve', 0) && exists('*popup_findinfo')
+endf
+
+" the info popup starts hidden, it's shown once the details of the selected
+" result are there
+fu! s:ccodeResolve()
+	let id = popup_findinfo()
+	let item = v:event.completed_item
+	if !id || empty(item) || get(item, 'user_data', '') == ''
+		return
+	endif
+
+	execute "silent let info = " . s:ccodeCommand('resolve',
+				\ [expand('%:p'), item.user_data])
+	if info.availability == -1
+		return
+	endif
+
+	let lines = [info.signature]
+	if info.availability == 1
+		let lines += ['(deprecated)']
+	elseif info.availability > 1
+		let lines += ['(not available)']
+	endif
+	if info.comment != ''
+		let lines += ['', info.comment]
+	endif
+	if info.parent != ''
+		let lines += ['', 'in ' . info.parent]
 	endif
+	call popup_settext(id, lines)
+	call popup_show(id)
 endf
 
 fu! s:ccodeInit()
 	setlocal omnifunc=CCodeComplete
+	augroup ccode_buffer
+		au! * <buffer>
+		au BufEnter <buffer> call s:ccodeOpen()
+		if s:ccodeResolving()
+			setlocal completeopt+=popuphidden
+			au CompleteChanged <buffer> call s:ccodeResolve()
+		endif
+		if s:ccodePaging()
+			au CompleteChanged <buffer> call s:ccodeMoreLater()
+		endif
+	augroup END
 endf
@@ -0,0 +1,91 @@
+#include "server.h"
+#include <stdlib.h>
+
+// for reference
+static void *worker_main(void *unused);
+static struct job *pop_job();
+
+//-------------------------------------------------------------------------
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct job *queue_head;
+static struct job *queue_tail;
+static int stopping;
+
+static pthread_t *threads;
+static int threads_n;
+static void (*job_handler)(struct job *job);
+
+void workers_start(int n, void (*handler)(struct job *job))
+{
+	if (n < 1)
+		n = 1;
+
+	job_handler = handler;
+	threads = malloc(sizeof(pthread_t) * n);
+	for (threads_n = 0; threads_n < n; threads_n++) {
+		if (pthread_create(&threads[threads_n], 0, worker_main, 0) != 0)
+			break;
+	}
+	if (!threads_n) {
+		fprintf(stderr, "Error! Failed to start worker threads.\n");
+		exit(1);
+	}
+}
+
+void workers_push(struct job *job)
+{
+	job->next = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void workers_stop()
+{
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	for (int i = 0; i < threads_n; ++i)
+		pthread_join(threads[i], 0);
+	free(threads);
+	threads = 0;
+	threads_n = 0;
+}
+
+// blocks until there is a job, returns zero when it's time to quit
+static struct job *pop_job()
+{
+	struct job *job;
+
+	pthread_mutex_lock(&queue_lock);
+	while (!queue_head && !stopping)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+
+	job = queue_head;
+	if (job) {
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = 0;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return job;
+}
+
+static void *worker_main(void *unused)
+{
+	struct job *job;
+
+	while ((job = pop_job()))
+		(*job_handler)(job);
+	return 0;
+}